@@ -1,69 +1,149 @@
-#pragma once
-
-#include <cstddef>
-#include <cstdlib>
-#include <memory>
-#include <utility>
-
-class ArenaAllocator final {
-public:
-    explicit ArenaAllocator(const std::size_t max_num_bytes)
-        : m_size { max_num_bytes }
-        , m_buffer { new std::byte[max_num_bytes] }
-        , m_offset { m_buffer }
-    {
-    }
-
-    ArenaAllocator(const ArenaAllocator&) = delete;
-    ArenaAllocator& operator=(const ArenaAllocator&) = delete;
-
-    ArenaAllocator(ArenaAllocator&& other) noexcept
-        : m_size { std::exchange(other.m_size, 0) }
-        , m_buffer { std::exchange(other.m_buffer, nullptr) }
-        , m_offset { std::exchange(other.m_offset, nullptr) }
-    {
-    }
-
-    ArenaAllocator& operator=(ArenaAllocator&& other) noexcept
-    {
-        std::swap(m_size, other.m_size);
-        std::swap(m_buffer, other.m_buffer);
-        std::swap(m_offset, other.m_offset);
-        return *this;
-    }
-
-    template <typename T>
-    [[nodiscard]] T* alloc()
-    {
-        std::size_t remaining_num_bytes = m_size - static_cast<std::size_t>(m_offset - m_buffer);
-        auto pointer = static_cast<void*>(m_offset);
-        const auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
-        if (aligned_address == nullptr) {
-            throw std::bad_alloc {};
-        }
-        m_offset = static_cast<std::byte*>(aligned_address) + sizeof(T);
-        return static_cast<T*>(aligned_address);
-    }
-
-    template <typename T, typename... Args>
-    [[nodiscard]] T* emplace(Args&&... args)
-    {
-        const auto allocated_memory = alloc<T>();
-        return new (allocated_memory) T { std::forward<Args>(args)... };
-    }
-
-    ~ArenaAllocator()
-    {
-        // No destructors are called for the stored objects. Thus, memory
-        // leaks are possible (e.g. when storing std::vector objects or
-        // other non-trivially destructable objects in the allocator).
-        // Although this could be changed, it would come with additional
-        // runtime overhead and therefore is not implemented.
-        delete[] m_buffer;
-    }
-
-private:
-    std::size_t m_size;
-    std::byte* m_buffer;
-    std::byte* m_offset;
-};
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+// Bump allocator that grows in chunks
+// Every chunk is twice as big as the one before, so the number of chunks
+// stays logarithmic in the total size and allocating is a pointer bump
+// except for the rare call that has to start a new chunk
+class ArenaAllocator final {
+public:
+    explicit ArenaAllocator(const std::size_t initial_num_bytes = 64 * 1024)
+        : m_next_chunk_size { std::max<std::size_t>(initial_num_bytes, 1024) }
+    {
+    }
+
+    ArenaAllocator(const ArenaAllocator&) = delete;
+    ArenaAllocator& operator=(const ArenaAllocator&) = delete;
+
+    ArenaAllocator(ArenaAllocator&& other) noexcept
+        : m_chunks { std::move(other.m_chunks) }
+        , m_offset { std::exchange(other.m_offset, nullptr) }
+        , m_end { std::exchange(other.m_end, nullptr) }
+        , m_next_chunk_size { other.m_next_chunk_size }
+    {
+        other.m_chunks.clear();
+    }
+
+    ArenaAllocator& operator=(ArenaAllocator&& other) noexcept
+    {
+        std::swap(m_chunks, other.m_chunks);
+        std::swap(m_offset, other.m_offset);
+        std::swap(m_end, other.m_end);
+        std::swap(m_next_chunk_size, other.m_next_chunk_size);
+        return *this;
+    }
+
+    template <typename T>
+    [[nodiscard]] T* alloc()
+    {
+        return static_cast<T*>(alloc_bytes(sizeof(T), alignof(T)));
+    }
+
+    // uninitialized storage for count objects of type T
+    template <typename T>
+    [[nodiscard]] T* alloc_array(const std::size_t count)
+    {
+        if (count > SIZE_MAX / sizeof(T)) {
+            throw std::bad_alloc {};
+        }
+        return static_cast<T*>(alloc_bytes(sizeof(T) * count, alignof(T)));
+    }
+
+    // Allocates and constructs a T
+    // Destructors never run, so only trivially destructible types are
+    // allowed, anything that needs to own memory should take it from the
+    // arena as well
+    template <typename T, typename... Args>
+    [[nodiscard]] T* emplace(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        const auto allocated_memory = alloc<T>();
+        return new (allocated_memory) T { std::forward<Args>(args)... };
+    }
+
+    ~ArenaAllocator()
+    {
+        // everything in the arena is trivially destructible (see emplace),
+        // so giving back the chunks is all there is to do
+        for (const Chunk& chunk : m_chunks) {
+            if (chunk.mapped) {
+                munmap(chunk.data, chunk.size);
+            } else {
+                delete[] chunk.data;
+            }
+        }
+    }
+
+private:
+    // chunks at least this big come straight from mmap and are offered to
+    // the kernel for transparent huge pages
+    // Only the names the symbol table copies live here, so this takes tens of
+    // megabytes of distinct identifiers, where every symbol lookup compares
+    // against text spread over the whole chunk and the TLB misses add up
+    static constexpr std::size_t huge_chunk_threshold = 32 * 1024 * 1024;
+    static constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+
+    struct Chunk {
+        std::byte* data;
+        std::size_t size;
+        bool mapped;
+    };
+
+    void* alloc_bytes(const std::size_t num_bytes, const std::size_t alignment)
+    {
+        const auto address = reinterpret_cast<std::uintptr_t>(m_offset);
+        const auto end = reinterpret_cast<std::uintptr_t>(m_end);
+        const std::uintptr_t aligned_address = (address + alignment - 1) & ~(alignment - 1);
+        if (m_offset != nullptr && aligned_address <= end && num_bytes <= end - aligned_address) {
+            m_offset = reinterpret_cast<std::byte*>(aligned_address + num_bytes);
+            return reinterpret_cast<void*>(aligned_address);
+        }
+        return alloc_in_new_chunk(num_bytes, alignment);
+    }
+
+    void* alloc_in_new_chunk(const std::size_t num_bytes, const std::size_t alignment)
+    {
+        std::size_t size = m_next_chunk_size;
+        while (size < num_bytes + alignment) {
+            size *= 2;
+        }
+        m_next_chunk_size = size * 2;
+
+        Chunk chunk { nullptr, size, false };
+        if (size >= huge_chunk_threshold) {
+            chunk.size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+            void* data = mmap(nullptr, chunk.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, chunk.size, MADV_HUGEPAGE);
+                chunk.data = static_cast<std::byte*>(data);
+                chunk.mapped = true;
+            }
+        }
+        if (chunk.data == nullptr) {
+            chunk.size = size;
+            chunk.data = new std::byte[size];
+        }
+        m_chunks.push_back(chunk);
+
+        m_offset = chunk.data;
+        m_end = chunk.data + chunk.size;
+        return alloc_bytes(num_bytes, alignment);
+    }
+
+    std::vector<Chunk> m_chunks;
+    std::byte* m_offset = nullptr;
+    std::byte* m_end = nullptr;
+    std::size_t m_next_chunk_size;
+};
+
@@ -0,0 +1,429 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "./parser.hpp"
+
+// 64 bit hash of the source text, the key of the AST cache
+// Same structure as xxHash64: four independent lanes eat 32 bytes a
+// round so the multiplies overlap, then the tail goes in 8, 4 and 1
+// bytes at a time
+inline uint64_t content_hash(const std::string_view text)
+{
+    constexpr uint64_t p1 = 0x9E3779B185EBCA87u;
+    constexpr uint64_t p2 = 0xC2B2AE3D27D4EB4Fu;
+    constexpr uint64_t p3 = 0x165667B19E3779F9u;
+    constexpr uint64_t p4 = 0x85EBCA77C2B2AE63u;
+    constexpr uint64_t p5 = 0x27D4EB2F165667C5u;
+    const auto rotl = [](const uint64_t x, const int r)
+    { return (x << r) | (x >> (64 - r)); };
+    const auto round = [&](uint64_t acc, const uint64_t lane)
+    { return rotl(acc + lane * p2, 31) * p1; };
+    const auto load64 = [](const char *p)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        return v;
+    };
+
+    const char *p = text.data();
+    const char *const end = p + text.size();
+    uint64_t h;
+    if (text.size() >= 32)
+    {
+        uint64_t v1 = p1 + p2;
+        uint64_t v2 = p2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -p1;
+        for (; end - p >= 32; p += 32)
+        {
+            v1 = round(v1, load64(p));
+            v2 = round(v2, load64(p + 8));
+            v3 = round(v3, load64(p + 16));
+            v4 = round(v4, load64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        for (const uint64_t v : {v1, v2, v3, v4})
+        {
+            h = (h ^ round(0, v)) * p1 + p4;
+        }
+    }
+    else
+    {
+        h = p5;
+    }
+    h += text.size();
+
+    for (; end - p >= 8; p += 8)
+    {
+        h = rotl(h ^ round(0, load64(p)), 27) * p1 + p4;
+    }
+    if (end - p >= 4)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        h = rotl(h ^ (v * p1), 23) * p2 + p3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h = rotl(h ^ (static_cast<unsigned char>(*p) * p5), 11) * p1;
+    }
+
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}
+
+// On disk cache of parsed programs, one file per source text named after
+// its content_hash. The file holds the NodeProg arrays as they are in
+// memory (children are indices, so nothing needs fixing up) and the
+// symbol names as offsets into one block of text.
+// Entries are written to a temporary file and renamed into place, so a
+// compiler running at the same time either sees the whole entry or none
+class AstCache
+{
+public:
+    // entries for progs parsed with different options are kept apart by flags
+    inline AstCache(std::string dir, const uint32_t flags)
+        : m_dir(std::move(dir)),
+          m_flags(flags)
+    {
+        if (mkdir(m_dir.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            std::cerr << "Unable to create cache directory " << m_dir << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    AstCache(const AstCache &) = delete;
+    AstCache &operator=(const AstCache &) = delete;
+
+    inline ~AstCache()
+    {
+        if (m_map != nullptr)
+        {
+            munmap(m_map, m_map_size);
+        }
+    }
+
+    // The cached program for src, if there is one
+    // symbols has to be empty, it gets the cached names with the same ids
+    // they had when the entry was written. The names are read straight from
+    // the mapped entry, so the cache has to outlive symbols
+    inline std::optional<NodeProg> load(const std::string_view src, SymbolTable &symbols)
+    {
+        const uint64_t hash = content_hash(src);
+        const int fd = open(path(hash).c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return {};
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header))
+        {
+            close(fd);
+            return {};
+        }
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            return {};
+        }
+        const auto *base = static_cast<const char *>(data);
+        const auto size = static_cast<uint64_t>(st.st_size);
+        Header header;
+        std::memcpy(&header, base, sizeof(Header));
+        // anything that doesn't match is treated as a miss and overwritten,
+        // the counts are checked one by one first so the layout can't overflow
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version || header.flags != m_flags ||
+            header.source_hash != hash || header.source_size != src.size() ||
+            header.nodes > size / sizeof(Node) || header.lists > size / sizeof(NodeIndex) ||
+            header.stmts > size / sizeof(NodeIndex) || header.symbols > size / sizeof(uint32_t) ||
+            header.name_bytes > size || layout(header).size != size)
+        {
+            munmap(data, st.st_size);
+            return {};
+        }
+
+        const Layout sections = layout(header);
+        NodeProg prog;
+        read_array(prog.nodes, base + sections.nodes, header.nodes);
+        read_array(prog.lists, base + sections.lists, header.lists);
+        read_array(prog.stmts, base + sections.stmts, header.stmts);
+        std::vector<uint32_t> name_ends;
+        read_array(name_ends, base + sections.name_ends, header.symbols);
+        if (!valid(prog, header.symbols) || !std::is_sorted(name_ends.begin(), name_ends.end()) ||
+            (!name_ends.empty() && name_ends.back() > header.name_bytes))
+        {
+            munmap(data, st.st_size);
+            return {};
+        }
+        if (m_map != nullptr)
+        {
+            munmap(m_map, m_map_size);
+        }
+        m_map = data;
+        m_map_size = st.st_size;
+
+        // a name that is there twice would shift the ids of the ones after
+        // it, the names interned up to there stay in symbols (and in the
+        // map) and the parse that follows the miss just reuses them
+        const char *names = base + sections.names;
+        uint32_t name_begin = 0;
+        for (uint64_t i = 0; i < header.symbols; i++)
+        {
+            if (symbols.intern_view({names + name_begin, name_ends[i] - name_begin}) != i)
+            {
+                return {};
+            }
+            name_begin = name_ends[i];
+        }
+        return prog;
+    }
+
+    // Writes the entry for src, failing to do so only costs the next run a parse
+    inline void store(const std::string_view src, const NodeProg &prog, const SymbolTable &symbols) const
+    {
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.flags = m_flags;
+        header.source_hash = content_hash(src);
+        header.source_size = src.size();
+        header.nodes = prog.nodes.size();
+        header.lists = prog.lists.size();
+        header.stmts = prog.stmts.size();
+        header.symbols = symbols.size();
+        std::vector<uint32_t> name_ends(symbols.size());
+        std::string names;
+        for (Symbol symbol = 0; symbol < symbols.size(); symbol++)
+        {
+            names += symbols.name(symbol);
+            name_ends[symbol] = static_cast<uint32_t>(names.size());
+        }
+        header.name_bytes = names.size();
+        const Layout sections = layout(header);
+
+        const std::string final_path = path(header.source_hash);
+        const std::string tmp_path = final_path + ".tmp" + std::to_string(getpid());
+        const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+        {
+            return;
+        }
+        Writer out{fd};
+        out.write(&header, sizeof(Header), 0);
+        out.write(prog.nodes.data(), prog.nodes.size() * sizeof(Node), sections.nodes);
+        out.write(prog.lists.data(), prog.lists.size() * sizeof(NodeIndex), sections.lists);
+        out.write(prog.stmts.data(), prog.stmts.size() * sizeof(NodeIndex), sections.stmts);
+        out.write(name_ends.data(), name_ends.size() * sizeof(uint32_t), sections.name_ends);
+        out.write(names.data(), names.size(), sections.names);
+        if (close(fd) != 0 || !out.ok || rename(tmp_path.c_str(), final_path.c_str()) != 0)
+        {
+            unlink(tmp_path.c_str());
+        }
+    }
+
+private:
+    static constexpr char magic[8] = {'A', 'S', 'K', 'I', 'A', 'S', 'T', '\0'};
+    // bump whenever Node or the file layout changes
+    static constexpr uint32_t version = 3;
+
+    static_assert(std::is_trivially_copyable_v<Node> && sizeof(Node) == 16);
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t flags;
+        uint64_t source_hash;
+        uint64_t source_size;
+        uint64_t nodes;
+        uint64_t lists;
+        uint64_t stmts;
+        uint64_t symbols;
+        uint64_t name_bytes;
+    };
+
+    // byte offsets of the sections, each starts 16 byte aligned
+    struct Layout
+    {
+        uint64_t nodes;
+        uint64_t lists;
+        uint64_t stmts;
+        uint64_t name_ends;
+        uint64_t names;
+        uint64_t size;
+    };
+
+    static inline Layout layout(const Header &header)
+    {
+        const auto align = [](const uint64_t offset)
+        { return (offset + 15) & ~uint64_t{15}; };
+        Layout sections{};
+        sections.nodes = align(sizeof(Header));
+        sections.lists = align(sections.nodes + header.nodes * sizeof(Node));
+        sections.stmts = align(sections.lists + header.lists * sizeof(NodeIndex));
+        sections.name_ends = align(sections.stmts + header.stmts * sizeof(NodeIndex));
+        sections.names = align(sections.name_ends + header.symbols * sizeof(uint32_t));
+        sections.size = sections.names + header.name_bytes;
+        return sections;
+    }
+
+    template <typename T>
+    static inline void read_array(std::vector<T> &out, const char *data, const uint64_t count)
+    {
+        out.resize(count);
+        if (count > 0)
+        {
+            std::memcpy(out.data(), data, count * sizeof(T));
+        }
+    }
+
+    // Every index in prog points at a node of the kind its slot expects and
+    // every symbol is one of the symbol_count names. Children always come
+    // before their parent in a parsed prog, which rules out cycles too
+    static inline bool valid(const NodeProg &prog, const uint64_t symbol_count)
+    {
+        const auto is_expr = [](const NodeKind kind)
+        { return kind == NodeKind::term_ident || kind == NodeKind::term_int_lit || is_bin_expr(kind); };
+        const auto is_stmt = [](const NodeKind kind)
+        { return kind >= NodeKind::stmt_exit && kind <= NodeKind::stmt_if; };
+
+        for (const NodeIndex stmt : prog.stmts)
+        {
+            if (stmt >= prog.nodes.size() || !is_stmt(prog.nodes[stmt].kind))
+            {
+                return false;
+            }
+        }
+        for (NodeIndex i = 0; i < prog.nodes.size(); i++)
+        {
+            const Node &node = prog.nodes[i];
+            const auto expr = [&](const NodeIndex child)
+            { return child < i && is_expr(prog.nodes[child].kind); };
+            const auto scope = [&](const NodeIndex child)
+            { return child < i && prog.nodes[child].kind == NodeKind::stmt_scope; };
+            const auto pred = [&](const NodeIndex child)
+            {
+                return child == no_node || (child < i && (prog.nodes[child].kind == NodeKind::if_pred_elif ||
+                                                          prog.nodes[child].kind == NodeKind::if_pred_else));
+            };
+            if (node.width > ImmWidth::imm64)
+            {
+                return false;
+            }
+            bool ok = false;
+            switch (node.kind)
+            {
+            case NodeKind::term_ident:
+                ok = node.a < symbol_count;
+                break;
+            case NodeKind::term_int_lit:
+                ok = true;
+                break;
+            case NodeKind::bin_add:
+            case NodeKind::bin_sub:
+            case NodeKind::bin_multi:
+            case NodeKind::bin_div:
+                ok = expr(node.a) && expr(node.b);
+                break;
+            case NodeKind::stmt_exit:
+                ok = expr(node.a);
+                break;
+            case NodeKind::stmt_let:
+            case NodeKind::stmt_const:
+                ok = node.a < symbol_count && expr(node.b) && node.c <= static_cast<uint32_t>(IntType::bool_);
+                break;
+            case NodeKind::stmt_scope:
+                ok = uint64_t{node.a} + node.b <= prog.lists.size() &&
+                     std::all_of(prog.lists.begin() + node.a, prog.lists.begin() + node.a + node.b,
+                                 [&](const NodeIndex stmt)
+                                 { return stmt < i && is_stmt(prog.nodes[stmt].kind); });
+                break;
+            case NodeKind::stmt_if:
+            case NodeKind::if_pred_elif:
+                ok = expr(node.a) && scope(node.b) && pred(node.c);
+                break;
+            case NodeKind::if_pred_else:
+                ok = scope(node.b);
+                break;
+            }
+            if (!ok)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // sequential writes with zero padding up to each section
+    struct Writer
+    {
+        int fd;
+        uint64_t offset = 0;
+        bool ok = true;
+
+        void at(const uint64_t target)
+        {
+            static constexpr char zeros[16] = {};
+            while (offset < target)
+            {
+                write(zeros, std::min<uint64_t>(target - offset, sizeof(zeros)), offset);
+            }
+        }
+
+        void write(const void *data, size_t size, const uint64_t target)
+        {
+            at(target);
+            const auto *bytes = static_cast<const char *>(data);
+            offset += size;
+            while (ok && size > 0)
+            {
+                const ssize_t n = ::write(fd, bytes, size);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    ok = false;
+                    return;
+                }
+                bytes += n;
+                size -= n;
+            }
+        }
+    };
+
+    [[nodiscard]] inline std::string path(const uint64_t hash) const
+    {
+        char name[48];
+        std::snprintf(name, sizeof(name), "/%016llx-%x.ast", static_cast<unsigned long long>(hash), m_flags);
+        return m_dir + name;
+    }
+
+    std::string m_dir;
+    const uint32_t m_flags;
+    void *m_map = nullptr;
+    size_t m_map_size = 0;
+};
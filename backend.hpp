@@ -0,0 +1,562 @@
+#pragma once
+#include <array>
+#include <cassert>
+#include <functional>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "./ir.hpp"
+
+// x86-64 asm for an IrProg, the same kind Generator makes
+// Instead of going through the stack, every value gets a home for as
+// long as it is needed: a register, or a stack slot when there are not
+// enough of those, or for constants no home at all since they go into
+// the instructions as immediates
+// Homes are handed out by linear scan over the blocks in reverse post
+// order. The CFG has no cycles (the language has no loops), so in that
+// order a value is needed from its definition up to its last use and
+// nowhere else
+// The IR is taken to be valid, see PassManager::verify_each_pass
+class X86Backend
+{
+public:
+    inline explicit X86Backend(const IrProg &ir)
+        : m_ir(ir)
+    {
+    }
+
+    [[nodiscard]] inline std::string gen_prog()
+    {
+        m_order = m_ir.reverse_post_order();
+        allocate();
+        find_labels();
+        m_output << "global _start\n_start:\n";
+        m_output << "    mov rbp, rsp\n";
+        if (m_slot_count > 0)
+        {
+            m_output << "    sub rsp, " << m_slot_count * 8 << "\n";
+        }
+        for (size_t i = 0; i < m_order.size(); i++)
+        {
+            gen_block(m_order[i], i + 1 < m_order.size() ? m_order[i + 1] : no_block);
+        }
+        if (m_trapping)
+        {
+            // every failed check ends up here and dies with SIGILL
+            m_output << trap_label << ":\n";
+            m_output << "    ud2\n";
+        }
+        return m_output.str();
+    }
+
+private:
+    enum Reg : uint8_t
+    {
+        rax,
+        rbx,
+        rcx,
+        rdx,
+        rsi,
+        rdi,
+        r8,
+        r9,
+        r10,
+        r11,
+        r12,
+        r13,
+        r14,
+        r15,
+    };
+
+    // by Reg, the names of its low 8, 16, 32 and 64 bits
+    static constexpr std::array<std::array<std::string_view, 4>, 14> reg_names{{
+        {"al", "ax", "eax", "rax"},
+        {"bl", "bx", "ebx", "rbx"},
+        {"cl", "cx", "ecx", "rcx"},
+        {"dl", "dx", "edx", "rdx"},
+        {"sil", "si", "esi", "rsi"},
+        {"dil", "di", "edi", "rdi"},
+        {"r8b", "r8w", "r8d", "r8"},
+        {"r9b", "r9w", "r9d", "r9"},
+        {"r10b", "r10w", "r10d", "r10"},
+        {"r11b", "r11w", "r11d", "r11"},
+        {"r12b", "r12w", "r12d", "r12"},
+        {"r13b", "r13w", "r13d", "r13"},
+        {"r14b", "r14w", "r14d", "r14"},
+        {"r15b", "r15w", "r15d", "r15"},
+    }};
+
+    // Registers values can live in. rax and rdx are taken by division and
+    // one operand multiplication, and like r11 they are scratch for
+    // operands that have to be in a register
+    static constexpr std::array<Reg, 11> value_regs = {rbx, rcx, rsi, rdi, r8, r9, r10, r12, r13, r14, r15};
+    static constexpr Reg scratch = r11;
+
+    struct Home
+    {
+        enum class Kind : uint8_t
+        {
+            none,
+            reg,
+            // 8 bytes below rbp, whatever the type, so it can be read at any width
+            slot,
+            constant,
+        } kind = Kind::none;
+        Reg reg = rax;
+        uint32_t slot = 0;
+        int64_t value = 0;
+    };
+
+    // Gives every vreg its Home
+    // A value that is defined at its operand's last use takes over the
+    // operand's register, so `x = a + b` mostly becomes one add. When
+    // more values are needed at once than there are registers, the one
+    // needed for the longest goes to a slot
+    inline void allocate()
+    {
+        m_homes.assign(m_ir.vreg_count, {});
+        std::vector<uint32_t> ends(m_ir.vreg_count, 0);
+        std::vector<uint32_t> rank(m_ir.blocks.size(), UINT32_MAX);
+        for (uint32_t i = 0; i < m_order.size(); i++)
+        {
+            rank[m_order[i]] = i;
+        }
+
+        uint32_t pos = 0;
+        for (const BlockId block : m_order)
+        {
+            for (const BlockId succ : m_ir.successors(block))
+            {
+                assert(rank[succ] > rank[block] && "the backend only handles CFGs without cycles");
+            }
+            for (const Inst &inst : m_ir.blocks[block].insts)
+            {
+                switch (inst.op)
+                {
+                case IrOp::const_:
+                    m_homes[inst.dst] = {.kind = Home::Kind::constant, .value = static_cast<int64_t>(IrProg::const_value(inst))};
+                    break;
+                case IrOp::jump:
+                    break;
+                case IrOp::branch:
+                case IrOp::exit:
+                    ends[inst.a] = std::max(ends[inst.a], pos);
+                    break;
+                default:
+                    ends[inst.a] = std::max(ends[inst.a], pos);
+                    ends[inst.b] = std::max(ends[inst.b], pos);
+                    break;
+                }
+                if (inst.dst != no_vreg)
+                {
+                    ends[inst.dst] = std::max(ends[inst.dst], pos);
+                }
+                pos++;
+            }
+        }
+
+        // values in registers, at most one per register
+        std::vector<VReg> active;
+        uint32_t free_regs = 0;
+        for (const Reg reg : value_regs)
+        {
+            free_regs |= 1u << reg;
+        }
+        // slots of values that are in one, soonest free first
+        using SlotUse = std::pair<uint32_t, uint32_t>;
+        std::priority_queue<SlotUse, std::vector<SlotUse>, std::greater<>> used_slots;
+        std::vector<uint32_t> free_slots;
+        const auto take_slot = [&](const VReg vreg)
+        {
+            uint32_t slot;
+            if (free_slots.empty())
+            {
+                slot = m_slot_count++;
+            }
+            else
+            {
+                slot = free_slots.back();
+                free_slots.pop_back();
+            }
+            m_homes[vreg] = {.kind = Home::Kind::slot, .slot = slot};
+            used_slots.push({ends[vreg], slot});
+        };
+
+        pos = 0;
+        for (const BlockId block : m_order)
+        {
+            for (const Inst &inst : m_ir.blocks[block].insts)
+            {
+                const uint32_t now = pos++;
+                if (inst.dst == no_vreg || inst.op == IrOp::const_)
+                {
+                    continue;
+                }
+                // values whose last use was before this are done
+                std::erase_if(active, [&](const VReg vreg)
+                              {
+                                  if (ends[vreg] >= now)
+                                  {
+                                      return false;
+                                  }
+                                  free_regs |= 1u << m_homes[vreg].reg;
+                                  return true; });
+                while (!used_slots.empty() && used_slots.top().first < now)
+                {
+                    free_slots.push_back(used_slots.top().second);
+                    used_slots.pop();
+                }
+
+                Home &a = m_homes[inst.a];
+                if (is_arithmetic(inst.op) && a.kind == Home::Kind::reg && ends[inst.a] == now)
+                {
+                    // a is read before dst is written
+                    std::erase(active, inst.a);
+                    m_homes[inst.dst] = {.kind = Home::Kind::reg, .reg = a.reg};
+                    active.push_back(inst.dst);
+                }
+                else if (free_regs != 0)
+                {
+                    const auto reg = static_cast<Reg>(__builtin_ctz(free_regs));
+                    free_regs &= ~(1u << reg);
+                    m_homes[inst.dst] = {.kind = Home::Kind::reg, .reg = reg};
+                    active.push_back(inst.dst);
+                }
+                else
+                {
+                    const auto victim = std::max_element(active.begin(), active.end(), [&](const VReg lhs, const VReg rhs)
+                                                         { return ends[lhs] < ends[rhs]; });
+                    if (ends[*victim] > ends[inst.dst])
+                    {
+                        m_homes[inst.dst] = {.kind = Home::Kind::reg, .reg = m_homes[*victim].reg};
+                        take_slot(*victim);
+                        *victim = inst.dst;
+                    }
+                    else
+                    {
+                        take_slot(inst.dst);
+                    }
+                }
+            }
+        }
+    }
+
+    // Only blocks that are jumped to get a label, the rest are fallen into
+    inline void find_labels()
+    {
+        m_labeled.assign(m_ir.blocks.size(), 0);
+        for (size_t i = 0; i < m_order.size(); i++)
+        {
+            const BlockId next = i + 1 < m_order.size() ? m_order[i + 1] : no_block;
+            const Inst &last = m_ir.blocks[m_order[i]].insts.back();
+            if (last.op == IrOp::jump && last.a != next)
+            {
+                m_labeled[last.a] = 1;
+            }
+            else if (last.op == IrOp::branch)
+            {
+                m_labeled[last.b] |= last.b != next;
+                m_labeled[last.c] |= last.c != next;
+            }
+        }
+        m_label_count = m_ir.blocks.size();
+    }
+
+    inline void gen_block(const BlockId block, const BlockId next)
+    {
+        if (m_labeled[block])
+        {
+            m_output << label_name(block) << ":\n";
+        }
+        for (const Inst &inst : m_ir.blocks[block].insts)
+        {
+            switch (inst.op)
+            {
+            case IrOp::const_:
+                break;
+            case IrOp::div:
+                gen_div(inst);
+                break;
+            case IrOp::jump:
+                if (inst.a != next)
+                {
+                    m_output << "    jmp " << label_name(inst.a) << "\n";
+                }
+                break;
+            case IrOp::branch:
+                gen_branch(inst, next);
+                break;
+            case IrOp::exit:
+                m_output << "    mov rax, 60\n";
+                load(rdi, inst.a, 8);
+                m_output << "    syscall\n";
+                break;
+            default:
+                gen_arith(inst);
+                break;
+            }
+        }
+    }
+
+    // Types narrower than 64 bits are computed in the 32 bit registers,
+    // what is above the type's width is never read, see Generator::gen_bin_expr
+    // Checked operations that might overflow work at the type's width
+    inline void gen_arith(const Inst &inst)
+    {
+        const bool trap_overflow = (inst.checks & check_overflow) != 0;
+        const unsigned size = trap_overflow || type_size(inst.type) == 8 ? type_size(inst.type) : 4;
+        const bool signed_type = is_signed(inst.type);
+        // the one operand forms only multiply rax
+        const bool one_operand = inst.op == IrOp::mul && trap_overflow && (!signed_type || size == 1);
+        const Home &dst = m_homes[inst.dst];
+        const Reg work = !one_operand && dst.kind == Home::Kind::reg ? dst.reg : rax;
+        load(work, inst.a, size);
+        const std::string_view reg = reg_name(work, size);
+        if (inst.op == IrOp::mul)
+        {
+            if (one_operand)
+            {
+                const std::string rhs = in_reg_or_memory(inst.b, size);
+                m_output << (signed_type ? "    imul " : "    mul ") << rhs << "\n";
+            }
+            else if (m_homes[inst.b].kind == Home::Kind::constant && fits_imm(inst.b, size))
+            {
+                m_output << "    imul " << reg << ", " << reg << ", " << m_homes[inst.b].value << "\n";
+            }
+            else
+            {
+                const std::string rhs = in_reg_or_memory(inst.b, size);
+                m_output << "    imul " << reg << ", " << rhs << "\n";
+            }
+        }
+        else
+        {
+            const std::string rhs = fits_imm(inst.b, size) ? operand(inst.b, size) : in_reg_or_memory(inst.b, size);
+            m_output << (inst.op == IrOp::add ? "    add " : "    sub ") << reg << ", " << rhs << "\n";
+        }
+        if (trap_overflow)
+        {
+            // add and sub of unsigned types carry out instead
+            const bool carry = inst.op != IrOp::mul && !signed_type;
+            m_output << (carry ? "    jc " : "    jo ") << trap_label << "\n";
+            m_trapping = true;
+        }
+        store(inst.dst, work);
+    }
+
+    // Dividend in rax, divisor in a register or memory, narrow operands
+    // extended to 32 bits first, see Generator::gen_div
+    inline void gen_div(const Inst &inst)
+    {
+        const unsigned size = type_size(inst.type);
+        const bool signed_type = is_signed(inst.type);
+        const char *extend = signed_type ? "movsx" : "movzx";
+        std::string divisor;
+        if (size < 4)
+        {
+            extend_to(rax, inst.a, size, extend);
+            extend_to(scratch, inst.b, size, extend);
+            divisor = reg_name(scratch, 4);
+        }
+        else
+        {
+            load(rax, inst.a, size);
+            divisor = in_reg_or_memory(inst.b, size);
+        }
+        const bool in_memory = m_homes[inst.b].kind == Home::Kind::slot && size >= 4;
+        if ((inst.checks & check_zero) != 0)
+        {
+            if (in_memory)
+            {
+                m_output << "    cmp " << divisor << ", 0\n";
+            }
+            else
+            {
+                m_output << "    test " << divisor << ", " << divisor << "\n";
+            }
+            m_output << "    jz " << trap_label << "\n";
+            m_trapping = true;
+        }
+        size_t done = no_label;
+        if ((inst.checks & check_overflow) != 0)
+        {
+            // the minimum divided by -1, done as a negation which sets OF
+            const size_t divide = m_label_count++;
+            done = m_label_count++;
+            m_output << "    cmp " << divisor << ", -1\n";
+            m_output << "    jne " << label_name(divide) << "\n";
+            m_output << "    neg " << reg_name(rax, size) << "\n";
+            m_output << "    jo " << trap_label << "\n";
+            m_output << "    jmp " << label_name(done) << "\n";
+            m_output << label_name(divide) << ":\n";
+            m_trapping = true;
+        }
+        // the upper half of the dividend is in rdx / edx
+        if (size == 8)
+        {
+            m_output << (signed_type ? "    cqo\n    idiv " : "    xor edx, edx\n    div ") << divisor << "\n";
+        }
+        else
+        {
+            m_output << (signed_type ? "    cdq\n    idiv " : "    xor edx, edx\n    div ") << divisor << "\n";
+        }
+        if (done != no_label)
+        {
+            m_output << label_name(done) << ":\n";
+        }
+        store(inst.dst, rax);
+    }
+
+    inline void gen_branch(const Inst &inst, const BlockId next)
+    {
+        const Home &condition = m_homes[inst.a];
+        const unsigned size = type_size(inst.type);
+        if (condition.kind == Home::Kind::constant)
+        {
+            const BlockId target = condition.value != 0 ? inst.b : inst.c;
+            if (target != next)
+            {
+                m_output << "    jmp " << label_name(target) << "\n";
+            }
+            return;
+        }
+        if (condition.kind == Home::Kind::slot)
+        {
+            m_output << "    cmp " << operand(inst.a, size) << ", 0\n";
+        }
+        else
+        {
+            const std::string_view reg = reg_name(condition.reg, size);
+            m_output << "    test " << reg << ", " << reg << "\n";
+        }
+        if (inst.b == next)
+        {
+            m_output << "    jz " << label_name(inst.c) << "\n";
+        }
+        else if (inst.c == next)
+        {
+            m_output << "    jnz " << label_name(inst.b) << "\n";
+        }
+        else
+        {
+            m_output << "    jz " << label_name(inst.c) << "\n";
+            m_output << "    jmp " << label_name(inst.b) << "\n";
+        }
+    }
+
+    // vreg into reg, only the low size bytes are of interest
+    inline void load(const Reg reg, const VReg vreg, const unsigned size)
+    {
+        const Home &home = m_homes[vreg];
+        if (home.kind == Home::Kind::reg && home.reg == reg)
+        {
+            return;
+        }
+        m_output << "    mov " << reg_name(reg, size) << ", " << operand(vreg, size) << "\n";
+    }
+
+    // vreg into the low 32 bits of reg, zero or sign extended from size
+    inline void extend_to(const Reg reg, const VReg vreg, const unsigned size, const char *extend)
+    {
+        if (m_homes[vreg].kind == Home::Kind::constant)
+        {
+            // constants are sign extended already when they are signed
+            m_output << "    mov " << reg_name(reg, 4) << ", " << m_homes[vreg].value << "\n";
+            return;
+        }
+        m_output << "    " << extend << " " << reg_name(reg, 4) << ", " << operand(vreg, size) << "\n";
+    }
+
+    // reg is where the value of vreg was computed
+    inline void store(const VReg vreg, const Reg reg)
+    {
+        const Home &home = m_homes[vreg];
+        if (home.kind == Home::Kind::reg && home.reg == reg)
+        {
+            return;
+        }
+        m_output << "    mov " << operand(vreg, 8) << ", " << reg_name(reg, 8) << "\n";
+    }
+
+    // the operand of an instruction that takes a register or memory
+    inline std::string in_reg_or_memory(const VReg vreg, const unsigned size)
+    {
+        if (m_homes[vreg].kind != Home::Kind::constant)
+        {
+            return operand(vreg, size);
+        }
+        load(scratch, vreg, size);
+        return std::string(reg_name(scratch, size));
+    }
+
+    // whether an instruction at size can take vreg as an immediate, only
+    // sign extended 32 bit ones exist for 64 bit operations
+    [[nodiscard]] inline bool fits_imm(const VReg vreg, const unsigned size) const
+    {
+        const Home &home = m_homes[vreg];
+        return home.kind == Home::Kind::constant && (size < 8 || (home.value >= INT32_MIN && home.value <= INT32_MAX));
+    }
+
+    // the register, memory or immediate operand for the low size bytes of vreg
+    [[nodiscard]] inline std::string operand(const VReg vreg, const unsigned size) const
+    {
+        const Home &home = m_homes[vreg];
+        switch (home.kind)
+        {
+        case Home::Kind::reg:
+            return std::string(reg_name(home.reg, size));
+        case Home::Kind::slot:
+            return std::string(size_name(size)) + " [rbp - " + std::to_string((home.slot + 1) * 8) + "]";
+        case Home::Kind::constant:
+            return std::to_string(home.value);
+        default:
+            assert(false && "value without a home");
+            return {};
+        }
+    }
+
+    static inline std::string_view reg_name(const Reg reg, const unsigned size)
+    {
+        return reg_names[reg][size == 1 ? 0 : size == 2 ? 1
+                                          : size == 4   ? 2
+                                                        : 3];
+    }
+
+    static inline std::string_view size_name(const unsigned size)
+    {
+        switch (size)
+        {
+        case 1:
+            return "BYTE";
+        case 2:
+            return "WORD";
+        case 4:
+            return "DWORD";
+        default:
+            return "QWORD";
+        }
+    }
+
+    static inline std::string label_name(const size_t label)
+    {
+        return "label" + std::to_string(label);
+    }
+
+    static constexpr size_t no_label = SIZE_MAX;
+    // the shared stub failed checks jump to
+    static constexpr std::string_view trap_label = "arith_trap";
+
+    const IrProg &m_ir;
+    // the blocks in the order they are generated
+    std::vector<BlockId> m_order;
+    // by VReg
+    std::vector<Home> m_homes;
+    uint32_t m_slot_count = 0;
+    // by BlockId, whether anything jumps to it
+    std::vector<uint8_t> m_labeled;
+    // labels are numbered after the blocks
+    size_t m_label_count = 0;
+    bool m_trapping = false;
+    std::stringstream m_output;
+};
@@ -0,0 +1,62 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "../generation.hpp"
+
+// Code generation time for programs of n lets, each using the one before
+// it, half of them inside nested scopes so scope exit is timed too
+// The time per let should stay flat as n grows
+
+// lets is a multiple of 2000, so the scopes line up with the second half
+static std::string make_program(const size_t lets)
+{
+    std::string src = "let v0 = 1;\n";
+    // the last let still in scope at the top level
+    std::string outer = "v0";
+    std::string prev = outer;
+    for (size_t i = 1; i < lets; i++)
+    {
+        // in the second half every thousand lets are a scope of their own
+        const bool scoped = i >= lets / 2;
+        if (scoped && i % 1000 == 0)
+        {
+            src += "if (" + outer + ") {\n";
+        }
+        const std::string name = "v" + std::to_string(i);
+        src += "let " + name + " = " + prev + " + " + std::to_string(i % 7) + ";\n";
+        prev = name;
+        if (!scoped)
+        {
+            outer = name;
+        }
+        else if (i % 1000 == 999)
+        {
+            src += "}\n";
+            prev = outer;
+        }
+    }
+    src += "exit(" + outer + ");\n";
+    return src;
+}
+
+int main()
+{
+    for (const size_t lets : {100'000, 200'000, 500'000, 1'000'000})
+    {
+        const std::string src = make_program(lets);
+        SymbolTable symbols;
+        const NodeProg prog = Parser(Tokenizer(src, symbols).tokenize()).parseProg().value();
+        double best = 1e30;
+        size_t bytes = 0;
+        for (int run = 0; run < 3; run++)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const std::string asm_text = Generator(prog, symbols).gen_prog();
+            const std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+            best = std::min(best, took.count());
+            bytes = asm_text.size();
+        }
+        std::printf("%8zu lets: %7.1f ms, %6.1f ns/let (%zu bytes of asm)\n", lets, best * 1e3, best * 1e9 / static_cast<double>(lets), bytes);
+    }
+    return EXIT_SUCCESS;
+}
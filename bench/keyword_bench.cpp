@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include "../tokenization.hpp"
+
+// Keyword lookup cost on identifier heavy input as the keyword list grows
+// The lists below are the real one with made up keywords added, each is
+// run through the same KeywordTable the tokenizer uses and, to compare,
+// through a chain of == the way keywords used to be recognised
+
+template <size_t Extra>
+constexpr auto with_extra_keywords(const std::array<std::string_view, 30> &extra)
+{
+    std::array<Keyword, keywords.size() + Extra> list{};
+    std::copy(keywords.begin(), keywords.end(), list.begin());
+    for (size_t i = 0; i < Extra; i++)
+    {
+        list[keywords.size() + i] = Keyword{extra[i], TokenType::ident};
+    }
+    return list;
+}
+
+inline constexpr std::array<std::string_view, 30> extra_spellings = {
+    "while", "for", "return", "fn", "struct", "enum", "match", "loop", "break", "continue",
+    "true", "false", "mut", "pub", "use", "mod", "impl", "trait", "type", "where",
+    "as", "in", "do", "case", "switch", "default", "static", "extern", "goto", "sizeof"};
+
+inline constexpr auto keywords_30 = with_extra_keywords<15>(extra_spellings);
+inline constexpr auto keywords_45 = with_extra_keywords<30>(extra_spellings);
+
+// mostly identifiers of 1 to 12 letters and digits, one word in ten a keyword
+static std::vector<std::string> make_words(const size_t count)
+{
+    std::mt19937 rng(7);
+    const std::string_view chars = "abcdefghijklmnopqrstuvwxyz0123456789_";
+    std::vector<std::string> words;
+    words.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (rng() % 10 == 0)
+        {
+            words.emplace_back(keywords[rng() % keywords.size()].spelling);
+            continue;
+        }
+        std::string word(1, chars[rng() % 26]);
+        const size_t length = 1 + rng() % 12;
+        while (word.size() < length)
+        {
+            word += chars[rng() % chars.size()];
+        }
+        words.push_back(std::move(word));
+    }
+    return words;
+}
+
+// best of a few runs, in nanoseconds per word
+template <typename Find>
+static double time_per_word(const std::vector<std::string> &words, Find find)
+{
+    double best = 1e30;
+    size_t found = 0;
+    for (int run = 0; run < 7; run++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        for (const std::string &word : words)
+        {
+            found += find(word) != nullptr;
+        }
+        const std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+        best = std::min(best, took.count() / static_cast<double>(words.size()));
+    }
+    // keeps the lookups from being optimised away
+    if (found == 0)
+    {
+        std::printf("no keywords found\n");
+    }
+    return best;
+}
+
+template <const auto &List>
+static const Keyword *find_by_compare(const std::string_view word)
+{
+    for (const Keyword &keyword : List)
+    {
+        if (keyword.spelling == word)
+        {
+            return &keyword;
+        }
+    }
+    return nullptr;
+}
+
+template <const auto &List>
+static void report(const std::vector<std::string> &words)
+{
+    const double hashed = time_per_word(words, KeywordTable<List>::find);
+    const double compared = time_per_word(words, find_by_compare<List>);
+    std::printf("%3zu keywords: %6.2f ns/word perfect hash, %6.2f ns/word == chain\n", List.size(), hashed, compared);
+}
+
+int main()
+{
+    const std::vector<std::string> words = make_words(1'000'000);
+    report<keywords>(words);
+    report<keywords_30>(words);
+    report<keywords_45>(words);
+    return EXIT_SUCCESS;
+}
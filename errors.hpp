@@ -0,0 +1,25 @@
+#pragma once
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// A mistake in the program being compiled, found by the tokenizer, the
+// parser or the TypeChecker
+// It is thrown where it is found and reported where the compile was
+// started, so a compile on several threads can stop all of them first
+// (see parallel_for and compile_pipelined) and --watch can wait for the
+// next edit instead of exiting
+class CompileError : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// throws a CompileError with the parts written one after the other
+template <typename... Parts>
+[[noreturn]] inline void fail(const Parts &...parts)
+{
+    std::ostringstream message;
+    (message << ... << parts);
+    throw CompileError(message.str());
+}
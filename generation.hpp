@@ -1,337 +1,682 @@
-#pragma once
-
-#include "./parser.hpp"
-#include <cassert>
-
-#include <algorithm>
-class Generator
-{
-public:
-    inline explicit Generator(NodeProg prog)
-        : m_prog(std::move(prog))
-    {
-    }
-
-    void gen_term(const NodeTerm *term)
-    {
-        struct TermVisitor
-        {
-            Generator &gen;
-            void operator()(const NodeTermIntLit *term_int_lit) const
-            {
-                gen.m_output << "    mov rax," << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
-            };
-            void operator()(const NodeTermIdent *term_ident) const
-            {
-                auto it = std::find_if(
-                    gen.m_vars.cbegin(),
-                    gen.m_vars.cend(),
-                    [&](const Var &var)
-                    { return var.name == term_ident->ident.value.value(); });
-                if (it == gen.m_vars.cend())
-                {
-                    std::cerr << "Identifier " << term_ident->ident.value.value() << " does not exist" << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]\n";
-                gen.push(offset.str());
-            }
-            void operator()(const NodeTermParen *term_paren) const
-            {
-                gen.gen_expr(term_paren->expr);
-            }
-        };
-
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
-    }
-
-    void gen_bin_expr(const NodeBinExpr *bin_expr)
-    {
-        struct BinExprVisitor
-        {
-            Generator &gen;
-            void operator()(const NodeBinExprSub *bin_expr_sub) const
-            {
-                gen.gen_expr(bin_expr_sub->rhs);
-                gen.gen_expr(bin_expr_sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprDiv *bin_expr_div) const
-            {
-                gen.gen_expr(bin_expr_div->rhs);
-                gen.gen_expr(bin_expr_div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprAdd *bin_expr_add) const
-            {
-                gen.gen_expr(bin_expr_add->rhs);
-                gen.gen_expr(bin_expr_add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprMulti *bin_expr_multi) const
-            {
-                gen.gen_expr(bin_expr_multi->rhs);
-                gen.gen_expr(bin_expr_multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
-            }
-        };
-        BinExprVisitor visitor({.gen = *this});
-        std::visit(visitor, bin_expr->var);
-    }
-
-    void gen_expr(const NodeExpr *expr)
-    {
-        struct ExprVisitor
-        {
-            Generator &gen;
-            void operator()(const NodeTerm *term) const
-            {
-                gen.gen_term(term);
-            }
-            void operator()(const NodeBinExpr *bin_expr) const
-            {
-                gen.gen_bin_expr(bin_expr);
-            }
-        };
-        ExprVisitor visitor{.gen = *this};
-        std::visit(visitor, expr->var);
-    }
-
-    void gen_scope(const NodeScope *scope)
-    {
-        begin_scope();
-        for (const NodeStmt *stmt : scope->stmts)
-        {
-            gen_stmt(stmt);
-        }
-        end_scope();
-    }
-
-    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label)
-
-
-
-    {
-
-
-        struct PredVisitor {
-
-
-            Generator& gen;
-
-
-            const std::string& end_label;
-
-
-
-
-
-            void operator()(const NodeIfPredElif* elif) const
-
-
-            {
-
-
-                gen.gen_expr(elif->expr);
-
-
-                gen.pop("rax");
-
-
-                const std::string label = gen.create_label();
-
-
-                gen.m_output << "    test rax, rax\n";
-
-
-                gen.m_output << "    jz " << label << "\n";
-
-
-                gen.gen_scope(elif->scope);
-
-
-                gen.m_output << "    jmp " << end_label << "\n";
-
-
-                if (elif->pred.has_value()) {
-
-
-                    gen.m_output << label << ":\n";
-
-
-                    gen.gen_if_pred(elif->pred.value(), end_label);
-
-
-                }
-
-
-            }
-
-            void operator()(const NodeIfPredElse* else_) const
-            {
-                gen.gen_scope(else_->scope);
-            }
-        };
-        PredVisitor visitor{ .gen = *this, .end_label = end_label };
-        std::visit(visitor, pred->var);
-    }
-    void gen_stmt(const NodeStmt *stmt)
-    {
-        struct StmtVisitor
-        {
-            Generator &gen;
-            void operator()(const NodeStmtExit *stmt_exit) const
-            {
-
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-            };
-            void operator()(const NodeStmtLet *stmt_let) const
-            {
-                auto it = std::find_if(
-                    gen.m_vars.cbegin(),
-                    gen.m_vars.cend(),
-                    [&](const Var &var)
-                    { return var.name == stmt_let->ident.value.value(); });
-
-                // if the variable is not in the vector(MAP)
-                // than and only create it
-                // otherwise exit with error
-                if (it != gen.m_vars.cend())
-                {
-                    std::cerr << "Identifier " << stmt_let->ident.value.value() << " already exists" << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size});
-                gen.gen_expr(stmt_let->expr);
-            }
-
-            // scope statements
-            void operator()(const NodeScope *scope) const
-            {
-                gen.gen_scope(scope);
-            }
-
-            void operator()(const NodeStmtIf *stmt_if) const
-            {
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                std::string label = gen.create_label();
-                gen.m_output << "    test rax,rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                gen.m_output << label << ":\n";
-                if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output <<  end_label<< ":\n";
-                }
-            }
-        };
-
-        StmtVisitor visitor{.gen = *this};
-        std::visit(visitor, stmt->var);
-    }
-
-    // Main Program generation template
-    [[nodiscard]] std::string
-    gen_prog()
-    {
-
-        m_output << "global _start\n_start:\n";
-
-        for (const NodeStmt *stmt : m_prog.stmts)
-        {
-            gen_stmt(stmt);
-        }
-
-        // if our program does not have an exit statement than exit with zero
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
-        return m_output.str();
-    }
-
-private:
-    // Pushing to the stack
-    // and incrementing the stack size
-    // taking the register name as an argument
-    void push(const std::string &reg)
-    {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
-    }
-
-    // Popping from the stack
-    // and decrementing the stack size
-    // taking the register name as an argument
-    void pop(const std::string &reg)
-    {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
-    }
-
-    void begin_scope()
-    {
-        m_scopes.push_back(m_vars.size());
-    }
-
-    void end_scope()
-    {
-        size_t popCount = m_vars.size() - m_scopes.back();
-        // Resetting the stack pointer
-        m_output << "    add rsp, " << popCount * 8 << "\n";
-        m_stack_size -= popCount;
-        for (int i = 0; i < popCount; i++)
-        {
-            m_vars.pop_back();
-        }
-        m_scopes.pop_back();
-    }
-
-    // label is used to create unique labels in assembly
-    // it mainly used for if statements
-    std::string create_label()
-    {
-        std::stringstream ss;
-        ss << "label" << m_label_count++;
-        return ss.str();
-    }
-
-    // this is struct that holds the location of the variable
-    // in future we will do add a types of this variable
-    // so we can do type checking
-    struct Var
-    {
-        std::string name;
-        size_t stack_loc;
-    };
-
-    const NodeProg m_prog;
-    std::stringstream m_output;
-    size_t m_stack_size = 0;
-    // vector(MAP) of variables
-    std::vector<Var> m_vars{};
-    // vector(STACK) of scopes
-    std::vector<size_t> m_scopes{};
-    int m_label_count = 0;
+#pragma once
+
+#include "./parser.hpp"
+#include "./ranges.hpp"
+#include "./typecheck.hpp"
+#include <cassert>
+#include <sstream>
+
+#include <algorithm>
+class Generator
+{
+public:
+    inline explicit Generator(NodeProg prog, const SymbolTable &symbols)
+        : m_prog(std::move(prog)),
+          m_checker(symbols)
+    {
+    }
+
+    // Streaming use: the program is handed over a few top level statements
+    // at a time with gen_stmts, between gen_start and gen_end, and the asm
+    // can be taken out as it is produced
+    inline explicit Generator(const SymbolTable &symbols)
+        : m_checker(symbols)
+    {
+    }
+
+    // Makes arithmetic that might overflow or divide by zero jump to a
+    // trap, the value ranges of the operands decide which operations
+    // might (see op_range)
+    void checked_arithmetic()
+    {
+        m_checked = true;
+        m_checker.checked_arithmetic();
+    }
+
+    void gen_term(const Node &term)
+    {
+        switch (term.kind)
+        {
+        case NodeKind::term_int_lit:
+            push_imm(m_prog.int_value(term), term.width);
+            break;
+        case NodeKind::term_ident:
+        {
+            const Var *var = find_var(term.a);
+            assert(var != nullptr && "undeclared identifiers are caught by TypeChecker");
+            // consts never get a slot, their value goes straight in
+            if (var->is_const)
+            {
+                push_imm(var->value, imm_width(var->value));
+                break;
+            }
+            // narrow loads fill the whole register so nothing depends on
+            // its old upper bits, what is above the type's width is never read
+            switch (type_size(var->type))
+            {
+            case 1:
+                m_output << "    movzx eax, BYTE " << slot(*var) << "\n";
+                break;
+            case 2:
+                m_output << "    movzx eax, WORD " << slot(*var) << "\n";
+                break;
+            case 4:
+                m_output << "    mov eax, DWORD " << slot(*var) << "\n";
+                break;
+            default:
+                push("QWORD " + slot(*var));
+                return;
+            }
+            push("rax");
+            break;
+        }
+        default:
+            assert(false && "not a term");
+        }
+    }
+
+    // Both operands are already on the stack, lhs on top
+    // Types narrower than 64 bits are computed in the 32 bit registers,
+    // which need no REX prefix. The low bits of a sum, difference or
+    // product only depend on the low bits of the operands, so the bits
+    // above the type's width are left as they come until a division
+    // Checked operations that might overflow work at the type's width
+    // instead, so the flags tell whether it did
+    void gen_bin_expr(const Node &bin_expr, const IntType type, const OpRange &range)
+    {
+        pop("rax");
+        pop("rbx");
+        const bool wide = type_size(type) == 8;
+        const bool trap_overflow = m_checked && range.may_overflow;
+        switch (bin_expr.kind)
+        {
+        case NodeKind::bin_sub:
+            if (trap_overflow)
+            {
+                m_output << "    sub " << reg_name(type) << ", " << rhs_reg_name(type) << "\n";
+                m_output << (is_signed(type) ? "    jo " : "    jc ") << trap_label << "\n";
+                break;
+            }
+            m_output << (wide ? "    sub rax, rbx\n" : "    sub eax, ebx\n");
+            break;
+        case NodeKind::bin_div:
+            gen_div(type, m_checked && range.may_divide_by_zero, trap_overflow);
+            break;
+        case NodeKind::bin_add:
+            if (trap_overflow)
+            {
+                m_output << "    add " << reg_name(type) << ", " << rhs_reg_name(type) << "\n";
+                m_output << (is_signed(type) ? "    jo " : "    jc ") << trap_label << "\n";
+                break;
+            }
+            m_output << (wide ? "    add rax, rbx\n" : "    add eax, ebx\n");
+            break;
+        case NodeKind::bin_multi:
+            if (trap_overflow)
+            {
+                // both set OF when the product doesn't fit, only imul has a
+                // two operand form and neither has one for bytes
+                if (!is_signed(type) || type_size(type) == 1)
+                {
+                    m_output << (is_signed(type) ? "    imul " : "    mul ") << rhs_reg_name(type) << "\n";
+                }
+                else
+                {
+                    m_output << "    imul " << reg_name(type) << ", " << rhs_reg_name(type) << "\n";
+                }
+                m_output << "    jo " << trap_label << "\n";
+                break;
+            }
+            // the low half is the same signed or unsigned, and unlike mul
+            // imul leaves rdx alone
+            m_output << (wide ? "    imul rax, rbx\n" : "    imul eax, ebx\n");
+            break;
+        default:
+            assert(false && "not a binary expression");
+        }
+        push("rax");
+    }
+
+    // Post order walk over the expression with an explicit stack,
+    // rhs is generated before lhs so lhs ends up on top
+    // All of an expression has the same type, see TypeChecker
+    // The value ranges of the operands are kept on a stack next to
+    // them, the range of the whole expression is returned
+    Interval gen_expr(const NodeIndex expr, const IntType type)
+    {
+        const size_t base = m_expr_stack.size();
+        m_expr_stack.push_back({expr, false});
+        while (m_expr_stack.size() > base)
+        {
+            const auto [index, operands_done] = m_expr_stack.back();
+            m_expr_stack.pop_back();
+            const Node &node = m_prog[index];
+            if (!is_bin_expr(node.kind))
+            {
+                gen_term(node);
+                m_ranges.push_back(term_range(node));
+            }
+            else if (operands_done)
+            {
+                const Interval lhs = m_ranges.back();
+                m_ranges.pop_back();
+                const OpRange range = op_range(node.kind, lhs, m_ranges.back(), type, m_checked);
+                gen_bin_expr(node, type, range);
+                m_ranges.back() = range.result;
+            }
+            else
+            {
+                m_expr_stack.push_back({index, true});
+                m_expr_stack.push_back({node.a, false});
+                m_expr_stack.push_back({node.b, false});
+            }
+        }
+        const Interval range = m_ranges.back();
+        m_ranges.pop_back();
+        return range;
+    }
+
+    // Statements are walked with an explicit stack of pending work instead
+    // of recursing into scopes and if chains, anything that has to happen
+    // after a nested scope is pushed below it
+    void gen_stmt(const NodeIndex stmt)
+    {
+        const size_t base = m_work.size();
+        m_work.push_back({.op = Work::Op::stmt, .node = stmt});
+        while (m_work.size() > base)
+        {
+            const Work work = m_work.back();
+            m_work.pop_back();
+            switch (work.op)
+            {
+            case Work::Op::stmt:
+                gen_stmt_node(work.node);
+                break;
+            case Work::Op::end_scope:
+                end_scope();
+                break;
+            case Work::Op::branch:
+                gen_branch(work.node, work.end_label);
+                break;
+            case Work::Op::branch_end:
+                // skip the rest of the chain
+                m_output << "    jmp " << label_name(work.end_label) << "\n";
+                m_output << label_name(work.label) << ":\n";
+                m_work.push_back({.op = Work::Op::branch, .node = m_prog[work.node].c, .end_label = work.end_label});
+                break;
+            case Work::Op::label:
+                m_output << label_name(work.label) << ":\n";
+                break;
+            }
+        }
+    }
+
+    // Main Program generation template
+    [[nodiscard]] std::string
+    gen_prog()
+    {
+        m_infos = m_checker.check(m_prog);
+        gen_start();
+        for (const NodeIndex stmt : m_prog.stmts)
+        {
+            gen_stmt(stmt);
+        }
+        gen_end();
+        return m_output.str();
+    }
+
+    // variables are addressed from rbp, the stack pointer keeps moving
+    // with the values of expressions
+    void gen_start()
+    {
+        m_output << "global _start\n_start:\n";
+        m_output << "    mov rbp, rsp\n";
+    }
+
+    // generates the top level statements of part, which replaces the prog
+    // generated before (variables and labels carry on)
+    void gen_stmts(NodeProg part)
+    {
+        m_prog = std::move(part);
+        m_infos = m_checker.check(m_prog);
+        for (const NodeIndex stmt : m_prog.stmts)
+        {
+            gen_stmt(stmt);
+        }
+    }
+
+    void gen_end()
+    {
+        // if our program does not have an exit statement than exit with zero
+        m_output << "    mov rax, 60\n";
+        m_output << "    mov rdi, 0\n";
+        m_output << "    syscall\n";
+        if (m_checked)
+        {
+            // every failed check ends up here and dies with SIGILL
+            m_output << trap_label << ":\n";
+            m_output << "    ud2\n";
+        }
+    }
+
+    // the asm generated since the last call
+    [[nodiscard]] std::string take_output()
+    {
+        std::string output = m_output.str();
+        m_output.str({});
+        return output;
+    }
+
+private:
+    void gen_stmt_node(const NodeIndex stmt)
+    {
+        const Node &node = m_prog[stmt];
+        switch (node.kind)
+        {
+        case NodeKind::stmt_exit:
+            // the exit status is only the low byte of rdi, whatever the type
+            if (m_infos[stmt].constant)
+            {
+                m_output << "    mov rax, 60\n";
+                m_output << "    mov rdi, " << static_cast<int64_t>(m_infos[stmt].value) << "\n";
+                m_output << "    syscall\n";
+                break;
+            }
+            gen_expr(node.a, m_infos[stmt].type);
+            m_output << "    mov rax, 60\n";
+            pop("rdi");
+            m_output << "    syscall\n";
+            break;
+        case NodeKind::stmt_let:
+        {
+            const ExprInfo &info = m_infos[stmt];
+            Var var{.name = node.a, .offset = alloc_slot(type_size(info.type)), .type = info.type, .range = Interval::point_of(info.value, info.type)};
+            const auto value = static_cast<int64_t>(info.value);
+            // a value known up front is stored straight away unless it needs a 64 bit immediate
+            if (info.constant && (type_size(var.type) < 8 || imm_width(value) <= ImmWidth::imm32))
+            {
+                m_output << "    mov " << size_name(var.type) << " " << slot(var) << ", " << value << "\n";
+            }
+            else
+            {
+                var.range = gen_expr(node.b, var.type);
+                pop("rax");
+                // storing only the type's width truncates to it
+                m_output << "    mov " << size_name(var.type) << " " << slot(var) << ", " << reg_name(var.type) << "\n";
+            }
+            add_var(var);
+            break;
+        }
+        case NodeKind::stmt_const:
+            add_var({.name = node.a, .type = m_infos[stmt].type, .is_const = true, .value = static_cast<int64_t>(m_infos[stmt].value)});
+            break;
+        // scope statements
+        case NodeKind::stmt_scope:
+        {
+            begin_scope();
+            m_work.push_back({.op = Work::Op::end_scope});
+            const std::span<const NodeIndex> stmts = m_prog.scope_stmts(node);
+            for (auto it = stmts.rbegin(); it != stmts.rend(); ++it)
+            {
+                m_work.push_back({.op = Work::Op::stmt, .node = *it});
+            }
+            break;
+        }
+        case NodeKind::stmt_if:
+            gen_branch(stmt, no_label);
+            break;
+        default:
+            assert(false && "not a statement");
+        }
+    }
+
+    // One link of an if chain: the if itself, an elif or the else
+    // A condition known at compile time picks its scope or the rest of the
+    // chain without any code. Otherwise a false condition jumps to the
+    // next link, and a taken scope jumps past the rest of the chain to
+    // end_label, which the first link that needs it makes
+    void gen_branch(const NodeIndex branch, size_t end_label)
+    {
+        const Node &node = m_prog[branch];
+        if (node.kind == NodeKind::if_pred_else)
+        {
+            m_work.push_back({.op = Work::Op::stmt, .node = node.b});
+            return;
+        }
+        const ExprInfo &info = m_infos[branch];
+        if (info.constant)
+        {
+            if (info.value != 0)
+            {
+                m_work.push_back({.op = Work::Op::stmt, .node = node.b});
+            }
+            else if (node.c != no_node)
+            {
+                m_work.push_back({.op = Work::Op::branch, .node = node.c, .end_label = end_label});
+            }
+            return;
+        }
+
+        gen_expr(node.a, info.type);
+        pop("rax");
+        const size_t label = create_label();
+        gen_test(info.type);
+        m_output << "    jz " << label_name(label) << "\n";
+        if (node.c == no_node)
+        {
+            m_work.push_back({.op = Work::Op::label, .label = label});
+        }
+        else
+        {
+            if (end_label == no_label)
+            {
+                end_label = create_label();
+                m_work.push_back({.op = Work::Op::label, .label = end_label});
+            }
+            m_work.push_back({.op = Work::Op::branch_end, .node = branch, .label = label, .end_label = end_label});
+        }
+        m_work.push_back({.op = Work::Op::stmt, .node = node.b});
+    }
+
+    // rax / eax is divided by rbx / ebx
+    // Division is the one operation that reads the bits above the type's
+    // width, so only here are narrow operands zero or sign extended first
+    // trap_overflow is for the minimum of a signed type divided by -1,
+    // that case is done as a negation which sets OF
+    void gen_div(const IntType type, const bool trap_zero, const bool trap_overflow)
+    {
+        const unsigned size = type_size(type);
+        const bool is_signed_type = is_signed(type);
+        if (trap_zero)
+        {
+            m_output << "    test " << rhs_reg_name(type) << ", " << rhs_reg_name(type) << "\n";
+            m_output << "    jz " << trap_label << "\n";
+        }
+        size_t done = no_label;
+        if (trap_overflow)
+        {
+            const size_t divide = create_label();
+            done = create_label();
+            m_output << "    cmp " << rhs_reg_name(type) << ", -1\n";
+            m_output << "    jne " << label_name(divide) << "\n";
+            m_output << "    neg " << reg_name(type) << "\n";
+            m_output << "    jo " << trap_label << "\n";
+            m_output << "    jmp " << label_name(done) << "\n";
+            m_output << label_name(divide) << ":\n";
+        }
+        if (size < 4)
+        {
+            const char *extend = is_signed_type ? "movsx" : "movzx";
+            m_output << "    " << extend << " eax, " << (size == 1 ? "al" : "ax") << "\n";
+            m_output << "    " << extend << " ebx, " << (size == 1 ? "bl" : "bx") << "\n";
+        }
+        // the upper half of the dividend is in rdx / edx
+        if (size == 8)
+        {
+            m_output << (is_signed_type ? "    cqo\n    idiv rbx\n" : "    xor edx, edx\n    div rbx\n");
+        }
+        else
+        {
+            m_output << (is_signed_type ? "    cdq\n    idiv ebx\n" : "    xor edx, edx\n    div ebx\n");
+        }
+        if (done != no_label)
+        {
+            m_output << label_name(done) << ":\n";
+        }
+    }
+
+    // the values term can have
+    [[nodiscard]] Interval term_range(const Node &term) const
+    {
+        if (term.kind == NodeKind::term_int_lit)
+        {
+            return Interval::point(m_prog.int_value(term));
+        }
+        const Var *var = find_var(term.a);
+        if (var->is_const)
+        {
+            // an untyped const is a u64 that fits type, see TypeChecker
+            return Interval::point_of(static_cast<uint64_t>(var->value), var->type);
+        }
+        return var->range;
+    }
+
+    // sets ZF if the value in rax is zero, only looking at the type's width
+    void gen_test(const IntType type)
+    {
+        const std::string_view reg = reg_name(type);
+        m_output << "    test " << reg << ", " << reg << "\n";
+    }
+
+    // Pushing to the stack
+    // taking the register name as an argument
+    void push(const std::string &reg)
+    {
+        m_output << "    push " << reg << "\n";
+    }
+
+    // picking the shortest encoding for the value,
+    // push takes a sign extended 32 bit immediate directly
+    void push_imm(const int64_t value, const ImmWidth width)
+    {
+        switch (width)
+        {
+        case ImmWidth::imm8:
+        case ImmWidth::imm32:
+            push(std::to_string(value));
+            break;
+        case ImmWidth::uimm32:
+            // writing eax zeroes the upper half of rax
+            m_output << "    mov eax, " << value << "\n";
+            push("rax");
+            break;
+        case ImmWidth::imm64:
+            m_output << "    mov rax, " << value << "\n";
+            push("rax");
+            break;
+        }
+    }
+
+    // Popping from the stack
+    // taking the register name as an argument
+    void pop(const std::string &reg)
+    {
+        m_output << "    pop " << reg << "\n";
+    }
+
+    // this is struct that holds the location of the variable,
+    // it takes type_size(type) bytes starting offset bytes below rbp
+    // A const has no location, just its value
+    struct Var
+    {
+        Symbol name;
+        size_t offset = 0;
+        IntType type;
+        bool is_const = false;
+        int64_t value = 0;
+        // what the variable can hold, see op_range
+        Interval range;
+    };
+
+    // Variables are packed below rbp, each aligned to its own size. The
+    // stack is only moved 8 bytes at a time when they outgrow it, so
+    // e.g. eight u8 variables share what used to be the slot of one
+    size_t alloc_slot(const size_t size)
+    {
+        m_frame_size = (m_frame_size + size + size - 1) / size * size;
+        if (m_frame_size > m_reserved)
+        {
+            const size_t grow = (m_frame_size - m_reserved + 7) / 8 * 8;
+            m_output << "    sub rsp, " << grow << "\n";
+            m_reserved += grow;
+        }
+        return m_frame_size;
+    }
+
+    static std::string slot(const Var &var)
+    {
+        return "[rbp - " + std::to_string(var.offset) + "]";
+    }
+
+    static std::string_view size_name(const IntType type)
+    {
+        switch (type_size(type))
+        {
+        case 1:
+            return "BYTE";
+        case 2:
+            return "WORD";
+        case 4:
+            return "DWORD";
+        default:
+            return "QWORD";
+        }
+    }
+
+    // the part of rbx that holds a value of the type
+    static std::string_view rhs_reg_name(const IntType type)
+    {
+        switch (type_size(type))
+        {
+        case 1:
+            return "bl";
+        case 2:
+            return "bx";
+        case 4:
+            return "ebx";
+        default:
+            return "rbx";
+        }
+    }
+
+    // the part of rax that holds a value of the type
+    static std::string_view reg_name(const IntType type)
+    {
+        switch (type_size(type))
+        {
+        case 1:
+            return "al";
+        case 2:
+            return "ax";
+        case 4:
+            return "eax";
+        default:
+            return "rax";
+        }
+    }
+
+    void begin_scope()
+    {
+        m_scopes.push_back({.vars = m_vars.size(), .frame_size = m_frame_size, .reserved = m_reserved});
+    }
+
+    void end_scope()
+    {
+        const Scope scope = m_scopes.back();
+        m_scopes.pop_back();
+        // Resetting the stack pointer
+        if (m_reserved > scope.reserved)
+        {
+            m_output << "    add rsp, " << m_reserved - scope.reserved << "\n";
+        }
+        m_frame_size = scope.frame_size;
+        m_reserved = scope.reserved;
+        while (m_vars.size() > scope.vars)
+        {
+            m_var_slots[m_vars.back().name] = 0;
+            m_vars.pop_back();
+        }
+    }
+
+    // the live variable called name, if there is one
+    [[nodiscard]] const Var *find_var(const Symbol name) const
+    {
+        if (name >= m_var_slots.size() || m_var_slots[name] == 0)
+        {
+            return nullptr;
+        }
+        return &m_vars[m_var_slots[name] - 1];
+    }
+
+    void add_var(const Var &var)
+    {
+        // sized from the names seen, in streaming use the lexer thread is
+        // still adding to the symbol table so its size can't be read here
+        if (var.name >= m_var_slots.size())
+        {
+            m_var_slots.resize(std::max<size_t>(var.name + 1, m_var_slots.size() * 2), 0);
+        }
+        m_vars.push_back(var);
+        m_var_slots[var.name] = static_cast<uint32_t>(m_vars.size());
+    }
+
+    // label is used to create unique labels in assembly
+    // it mainly used for if statements
+    size_t create_label()
+    {
+        return m_label_count++;
+    }
+
+    static constexpr size_t no_label = SIZE_MAX;
+    // the shared stub failed checks jump to
+    static constexpr std::string_view trap_label = "arith_trap";
+
+    static std::string label_name(const size_t label)
+    {
+        return "label" + std::to_string(label);
+    }
+
+    NodeProg m_prog;
+    TypeChecker m_checker;
+    // by statement NodeIndex of m_prog, what TypeChecker knows of its expression
+    std::vector<ExprInfo> m_infos;
+    std::stringstream m_output;
+    bool m_checked = false;
+    // bytes below rbp taken by variables, and taken from the stack for them
+    size_t m_frame_size = 0;
+    size_t m_reserved = 0;
+    // live variables in the order they were declared, so leaving a scope
+    // pops its own off the end
+    std::vector<Var> m_vars{};
+    // by Symbol, index + 1 of the variable in m_vars (0 if there is none)
+    // Symbols are dense ids already, so they index the table directly
+    // instead of going through a hash. No variable shadows another, so
+    // one slot per name is enough and end_scope just clears it
+    std::vector<uint32_t> m_var_slots{};
+    // what to go back to at the end of each open scope
+    struct Scope
+    {
+        size_t vars;
+        size_t frame_size;
+        size_t reserved;
+    };
+    // vector(STACK) of scopes
+    std::vector<Scope> m_scopes{};
+    size_t m_label_count = 0;
+
+    // what is left to do for the statements being generated
+    struct Work
+    {
+        enum class Op : uint8_t
+        {
+            // generate the statement in node
+            stmt,
+            end_scope,
+            // generate the if chain link in node, taken links jump to end_label
+            branch,
+            // after the scope of the if or elif in node: jump to end_label,
+            // place label and go on with the next link
+            branch_end,
+            // place label
+            label,
+        } op;
+        NodeIndex node = no_node;
+        size_t label = 0;
+        size_t end_label = 0;
+    };
+    std::vector<Work> m_work;
+    // (node, operands already generated) pairs of gen_expr
+    std::vector<std::pair<NodeIndex, bool>> m_expr_stack;
+    // value ranges of the operands gen_expr has on the stack
+    std::vector<Interval> m_ranges;
 };
\ No newline at end of file
@@ -0,0 +1,378 @@
+#pragma once
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "./errors.hpp"
+#include "./parser.hpp"
+
+// Front end that keeps the AST of a source buffer up to date across edits
+// An edit only re-lexes and reparses the statements around it in the
+// innermost scope that has it inside its braces. The new statements are
+// appended to the NodeProg and spliced into that scope's list (or the top
+// level), every other node is left where it is
+// Text with a mistake in it leaves everything as it was before, so the
+// next edit is made to the last text that parsed
+class IncrementalParser
+{
+public:
+    inline explicit IncrementalParser(SymbolTable &symbols)
+        : m_symbols(symbols)
+    {
+    }
+
+    // Parses text from scratch, false (with the mistake reported) if it
+    // doesn't parse
+    inline bool parse(std::string text)
+    {
+        std::string old = std::exchange(m_src, std::move(text));
+        try
+        {
+            full_parse();
+            return true;
+        }
+        catch (const CompileError &error)
+        {
+            std::cerr << error.what() << std::endl;
+            m_src = std::move(old);
+            return false;
+        }
+    }
+
+    // Replaces the bytes [begin, end) of the current text with
+    // replacement, false (with the mistake reported) if the new text
+    // doesn't parse
+    inline bool edit(const size_t begin, const size_t end, const std::string_view replacement)
+    {
+        const std::string replaced = m_src.substr(begin, end - begin);
+        const size_t edit_count = m_edits.size();
+        m_src.replace(begin, end - begin, replacement);
+        try
+        {
+            apply_edit(begin, end, replacement.size());
+            return true;
+        }
+        catch (const CompileError &error)
+        {
+            std::cerr << error.what() << std::endl;
+            m_src.replace(begin, replacement.size(), replaced);
+            m_edits.resize(edit_count);
+            return false;
+        }
+    }
+
+    [[nodiscard]] inline const NodeProg &prog() const
+    {
+        return m_prog;
+    }
+
+    [[nodiscard]] inline std::string_view source() const
+    {
+        return m_src;
+    }
+
+private:
+    // brings the prog up to date with the edit of [begin, end) m_src has
+    // had already, throws a CompileError without changing the prog if the
+    // text doesn't parse
+    inline void apply_edit(const size_t begin, const size_t end, const size_t replacement_size)
+    {
+        const size_t old_size = m_src.size() + (end - begin) - replacement_size;
+
+        // nodes of replaced statements stay behind as garbage,
+        // start over once there is about as much of it as live nodes
+        if (m_prog.nodes.size() > 2 * m_full_parse_nodes + 1024)
+        {
+            full_parse();
+            return;
+        }
+
+        const std::vector<Region> regions = find_regions(begin, end, old_size);
+        m_edits.push_back({.begin = begin, .end = end, .delta = static_cast<int64_t>(replacement_size) - static_cast<int64_t>(end - begin)});
+        // innermost first, a region that doesn't hold whole statements of
+        // its list after the edit is widened to the enclosing statement
+        for (auto region = regions.rbegin(); region != regions.rend(); ++region)
+        {
+            if (reparse(*region))
+            {
+                if (m_edits.size() >= 256)
+                {
+                    rebase();
+                }
+                return;
+            }
+        }
+        full_parse();
+    }
+
+    // an edit, in the coordinates from before it was made
+    struct Edit
+    {
+        size_t begin;
+        size_t end;
+        int64_t delta;
+    };
+
+    // Statements [first, last) of a list (the scope's, or the top level
+    // for no_node) and the bytes they cover before the edit
+    // The region also takes the statement on either side of the edit,
+    // so e.g. an `else` typed after an `if` joins it
+    struct Region
+    {
+        NodeIndex scope;
+        size_t first;
+        size_t last;
+        size_t begin;
+        size_t end;
+        // whether the region stops at a statement or runs to the end of the
+        // file (top level) or of the scope (never reparsed on its own)
+        bool bounded;
+    };
+
+    // nothing changes until the whole text has parsed
+    inline void full_parse()
+    {
+        Parser parser(Tokenizer(m_src, m_symbols, true).tokenize_with_offsets());
+        std::vector<Span> spans;
+        parser.record_spans(spans);
+        m_prog = parser.parseProg().value();
+        m_spans = std::move(spans);
+        m_spans.resize(m_prog.nodes.size());
+        m_span_edits.assign(m_prog.nodes.size(), 0);
+        m_edits.clear();
+        m_full_parse_nodes = m_prog.nodes.size();
+    }
+
+    [[nodiscard]] inline std::span<const NodeIndex> list(const NodeIndex scope) const
+    {
+        return scope == no_node ? std::span<const NodeIndex>(m_prog.stmts) : m_prog.scope_stmts(m_prog[scope]);
+    }
+
+    // Span of node in the current coordinates, the edits made after it was
+    // parsed move it. Nodes that are still in the tree never overlap an
+    // edit, so a begin only moves when it is past the edit and an end when
+    // it is past the start of the edit
+    [[nodiscard]] inline Span span(const NodeIndex node) const
+    {
+        size_t begin = m_spans[node].begin;
+        size_t end = m_spans[node].end;
+        for (size_t i = m_span_edits[node]; i < m_edits.size(); i++)
+        {
+            const Edit &edit = m_edits[i];
+            if (begin >= edit.end)
+            {
+                begin += edit.delta;
+            }
+            if (end > edit.begin)
+            {
+                end += edit.delta;
+            }
+        }
+        return {static_cast<uint32_t>(begin), static_cast<uint32_t>(end)};
+    }
+
+    // applies the pending edits to all spans so span() stays cheap
+    inline void rebase()
+    {
+        for (NodeIndex node = 0; node < m_spans.size(); node++)
+        {
+            m_spans[node] = span(node);
+        }
+        std::fill(m_span_edits.begin(), m_span_edits.end(), 0);
+        m_edits.clear();
+    }
+
+    // scope of stmt (or of one of its if preds) that has [begin, end) strictly
+    // inside its braces
+    [[nodiscard]] inline NodeIndex enclosing_scope(const NodeIndex stmt, const size_t begin, const size_t end) const
+    {
+        const auto inside = [&](const NodeIndex scope)
+        {
+            const Span braces = span(scope);
+            return braces.begin < begin && end < braces.end;
+        };
+        const Node &node = m_prog[stmt];
+        if (node.kind == NodeKind::stmt_scope)
+        {
+            return inside(stmt) ? stmt : no_node;
+        }
+        if (node.kind != NodeKind::stmt_if)
+        {
+            return no_node;
+        }
+        if (inside(node.b))
+        {
+            return node.b;
+        }
+        for (NodeIndex pred = node.c; pred != no_node;)
+        {
+            const Node &pred_node = m_prog[pred];
+            if (inside(pred_node.b))
+            {
+                return pred_node.b;
+            }
+            pred = pred_node.kind == NodeKind::if_pred_elif ? pred_node.c : no_node;
+        }
+        return no_node;
+    }
+
+    // the regions around [begin, end) from the top level down to the
+    // innermost scope holding the edit
+    [[nodiscard]] inline std::vector<Region> find_regions(const size_t begin, const size_t end, const size_t old_size) const
+    {
+        std::vector<Region> regions;
+        NodeIndex scope = no_node;
+        while (true)
+        {
+            const std::span<const NodeIndex> stmts = list(scope);
+            // statements overlapping the edit are [lo, hi)
+            const size_t lo = std::partition_point(stmts.begin(), stmts.end(), [&](const NodeIndex stmt)
+                                                   { return span(stmt).end <= begin; }) -
+                              stmts.begin();
+            const size_t hi = std::partition_point(stmts.begin(), stmts.end(), [&](const NodeIndex stmt)
+                                                   { return span(stmt).begin < end; }) -
+                              stmts.begin();
+
+            Region region{.scope = scope, .first = lo > 0 ? lo - 1 : lo, .last = hi, .bounded = hi < stmts.size()};
+            if (lo > 0)
+            {
+                region.begin = span(stmts[lo - 1]).begin;
+            }
+            else
+            {
+                region.begin = scope == no_node ? 0 : span(scope).begin + 1;
+            }
+            if (region.bounded)
+            {
+                region.last = hi + 1;
+                region.end = span(stmts[hi]).end;
+            }
+            else
+            {
+                region.end = scope == no_node ? old_size : span(scope).end - 1;
+            }
+            regions.push_back(region);
+
+            if (hi - lo != 1)
+            {
+                return regions;
+            }
+            scope = enclosing_scope(stmts[lo], begin, end);
+            if (scope == no_node)
+            {
+                return regions;
+            }
+        }
+    }
+
+    // The region has to still hold whole statements of its list after the
+    // edit: braces balanced, and its last token has to end it (an edit
+    // that opens a comment would swallow what follows). Then the list can
+    // be parsed on its own and gives what a full parse would
+    inline bool reparse(const Region &region)
+    {
+        if (!region.bounded && region.scope != no_node)
+        {
+            return false;
+        }
+        const Edit &edit = m_edits.back();
+        const size_t end = region.end + edit.delta;
+        const std::string_view text = std::string_view(m_src).substr(region.begin, end - region.begin);
+        TokenBuffer tokens = Tokenizer(text, m_symbols, true).tokenize_with_offsets();
+
+        size_t depth = 0;
+        for (size_t i = 0; i < tokens.size(); i++)
+        {
+            if (tokens.type(i) == TokenType::open_curly)
+            {
+                depth++;
+            }
+            else if (tokens.type(i) == TokenType::close_curly && depth-- == 0)
+            {
+                return false;
+            }
+        }
+        if (depth != 0)
+        {
+            return false;
+        }
+        if (region.bounded && (tokens.size() == 0 || tokens.offset(tokens.size() - 1) + 1 != text.size()))
+        {
+            return false;
+        }
+
+        const size_t first_node = m_prog.nodes.size();
+        const size_t first_list = m_prog.lists.size();
+        Parser parser(std::move(tokens), std::move(m_prog));
+        parser.record_spans(m_spans, static_cast<uint32_t>(region.begin));
+        std::vector<NodeIndex> stmts;
+        try
+        {
+            parser.parse_stmts(stmts);
+        }
+        catch (const CompileError &)
+        {
+            // the parser only appends, so dropping what it added is enough
+            m_prog = parser.take_prog();
+            m_prog.nodes.resize(first_node);
+            m_prog.lists.resize(first_list);
+            m_spans.resize(first_node);
+            throw;
+        }
+        m_prog = parser.take_prog();
+        m_spans.resize(m_prog.nodes.size());
+        m_span_edits.resize(m_prog.nodes.size());
+        std::fill(m_span_edits.begin() + first_node, m_span_edits.end(), m_edits.size());
+
+        splice(region, stmts);
+        return true;
+    }
+
+    // replaces the region's statements in its list with stmts
+    inline void splice(const Region &region, const std::vector<NodeIndex> &stmts)
+    {
+        if (region.scope == no_node)
+        {
+            auto &top = m_prog.stmts;
+            top.erase(top.begin() + region.first, top.begin() + region.last);
+            top.insert(top.begin() + region.first, stmts.begin(), stmts.end());
+            return;
+        }
+
+        Node &scope = m_prog.nodes[region.scope];
+        if (region.last - region.first == stmts.size())
+        {
+            std::copy(stmts.begin(), stmts.end(), m_prog.lists.begin() + scope.a + region.first);
+            return;
+        }
+        // the list no longer fits where it was, it moves to the end
+        auto &lists = m_prog.lists;
+        const size_t count = scope.b - (region.last - region.first) + stmts.size();
+        const size_t start = lists.size();
+        lists.reserve(start + count);
+        for (size_t i = 0; i < region.first; i++)
+        {
+            lists.push_back(lists[scope.a + i]);
+        }
+        lists.insert(lists.end(), stmts.begin(), stmts.end());
+        for (size_t i = region.last; i < scope.b; i++)
+        {
+            lists.push_back(lists[scope.a + i]);
+        }
+        scope.a = static_cast<uint32_t>(start);
+        scope.b = static_cast<uint32_t>(count);
+    }
+
+    SymbolTable &m_symbols;
+    std::string m_src;
+    NodeProg m_prog;
+    // by NodeIndex, only meaningful for statements and scopes
+    std::vector<Span> m_spans;
+    // by NodeIndex, how many of m_edits had been made when it was parsed
+    std::vector<uint32_t> m_span_edits;
+    // edits not yet applied to m_spans
+    std::vector<Edit> m_edits;
+    size_t m_full_parse_nodes = 0;
+};
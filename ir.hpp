@@ -0,0 +1,619 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "./typecheck.hpp"
+#include "./types.hpp"
+
+// Mid level IR between the AST and the asm: typed SSA over basic blocks
+// Every value is a virtual register that is assigned exactly once, by one
+// instruction, and has the type of that instruction. Control flow only
+// happens at the end of a block, where exactly one terminator says where
+// to go next. Variables can't be assigned again, so no value depends on
+// the way a block was entered and there are no phis
+using VReg = uint32_t;
+using BlockId = uint32_t;
+inline constexpr VReg no_vreg = UINT32_MAX;
+inline constexpr BlockId no_block = UINT32_MAX;
+
+enum class IrOp : uint8_t
+{
+    // dst = value split over b (low half) and c (high half), like
+    // term_int_lit, wrapped to the type (see wrap_to)
+    const_,
+    // dst = a op b, wrapping around at the type's width unless checks say otherwise
+    add,
+    sub,
+    mul,
+    div,
+    // the terminators
+    // go to block a
+    jump,
+    // go to block b if a is not zero, else to block c, type is a's
+    branch,
+    // exit(a), the program ends here, type is a's
+    exit,
+};
+
+// what arithmetic has to trap on, see Generator::checked_arithmetic
+inline constexpr uint8_t check_overflow = 1;
+inline constexpr uint8_t check_zero = 2;
+
+struct Inst
+{
+    IrOp op;
+    IntType type = IntType::none;
+    uint8_t checks = 0;
+    // no_vreg for terminators
+    VReg dst = no_vreg;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+};
+
+struct Block
+{
+    std::vector<Inst> insts;
+};
+
+inline bool is_terminator(const IrOp op)
+{
+    return op >= IrOp::jump;
+}
+
+inline bool is_arithmetic(const IrOp op)
+{
+    return op >= IrOp::add && op <= IrOp::div;
+}
+
+struct IrProg
+{
+    // block 0 is where the program starts
+    std::vector<Block> blocks;
+    uint32_t vreg_count = 0;
+
+    VReg new_vreg()
+    {
+        return vreg_count++;
+    }
+
+    BlockId add_block()
+    {
+        blocks.emplace_back();
+        return static_cast<BlockId>(blocks.size() - 1);
+    }
+
+    static Inst constant(const VReg dst, const IntType type, const uint64_t value)
+    {
+        return {.op = IrOp::const_, .type = type, .dst = dst, .b = static_cast<uint32_t>(value), .c = static_cast<uint32_t>(value >> 32)};
+    }
+
+    [[nodiscard]] static uint64_t const_value(const Inst &inst)
+    {
+        return static_cast<uint64_t>(inst.b) | (static_cast<uint64_t>(inst.c) << 32);
+    }
+
+    // the blocks control can go to from block, in the order of the terminator
+    [[nodiscard]] std::vector<BlockId> successors(const BlockId block) const
+    {
+        const std::vector<Inst> &insts = blocks[block].insts;
+        if (insts.empty())
+        {
+            return {};
+        }
+        const Inst &last = insts.back();
+        switch (last.op)
+        {
+        case IrOp::jump:
+            return {last.a};
+        case IrOp::branch:
+            return {last.b, last.c};
+        default:
+            return {};
+        }
+    }
+
+    // by block, the blocks that end by going to it (a block that branches
+    // to it both ways is there twice)
+    [[nodiscard]] std::vector<std::vector<BlockId>> predecessors() const
+    {
+        std::vector<std::vector<BlockId>> preds(blocks.size());
+        for (BlockId block = 0; block < blocks.size(); block++)
+        {
+            for (const BlockId succ : successors(block))
+            {
+                preds[succ].push_back(block);
+            }
+        }
+        return preds;
+    }
+
+    // The blocks that can be reached from the start, each one before the
+    // blocks it goes to (unless through a back edge). The first target of
+    // a branch comes before the second, so code mostly falls through
+    [[nodiscard]] std::vector<BlockId> reverse_post_order() const
+    {
+        std::vector<BlockId> order;
+        std::vector<uint8_t> seen(blocks.size(), 0);
+        // (block, successors already pushed)
+        std::vector<std::pair<BlockId, bool>> stack{{0, false}};
+        while (!stack.empty())
+        {
+            const auto [block, done] = stack.back();
+            stack.pop_back();
+            if (done)
+            {
+                order.push_back(block);
+                continue;
+            }
+            // a block can be pushed by several predecessors, only the
+            // first visit counts, or a block could end up before one of its
+            // predecessors
+            if (seen[block])
+            {
+                continue;
+            }
+            seen[block] = 1;
+            stack.push_back({block, true});
+            const std::vector<BlockId> succs = successors(block);
+            // the first successor is visited last, so it ends up first
+            for (const BlockId succ : succs)
+            {
+                if (!seen[succ])
+                {
+                    stack.push_back({succ, false});
+                }
+            }
+        }
+        std::reverse(order.begin(), order.end());
+        return order;
+    }
+};
+
+// Which blocks dominate which: every way from the start to a block
+// goes through each of its dominators. Only covers the blocks that can
+// be reached
+struct DominatorTree
+{
+    // by block, the closest dominator other than itself (the start's is
+    // the start), no_block if it can't be reached
+    std::vector<BlockId> idom;
+    // by block, the blocks it is the closest dominator of
+    std::vector<std::vector<BlockId>> children;
+    // numbered in and out of a walk over the tree, a block dominates
+    // exactly the blocks numbered inside its own numbers
+    std::vector<uint32_t> enter;
+    std::vector<uint32_t> leave;
+
+    // Lowering only makes CFGs without cycles, so in reverse post order
+    // every predecessor of a block comes before it, and one pass makes
+    // each block's closest dominator the closest common ancestor of its
+    // predecessors in the tree so far. Ancestors are found by binary
+    // lifting, which keeps it O(edges * log(blocks)) however deep the
+    // tree gets (an if chain makes it as deep as it is long)
+    // See IrProg::predecessors and IrProg::reverse_post_order
+    static DominatorTree build(const std::vector<std::vector<BlockId>> &preds, const std::vector<BlockId> &order)
+    {
+        const size_t size = preds.size();
+        DominatorTree tree;
+        std::vector<uint32_t> rank(size, UINT32_MAX);
+        for (uint32_t i = 0; i < order.size(); i++)
+        {
+            rank[order[i]] = i;
+        }
+        std::vector<BlockId> &idom = tree.idom;
+        idom.assign(size, no_block);
+        idom[0] = 0;
+        std::vector<uint32_t> depth(size, 0);
+        // up[level * size + block] is the dominator 2^level steps up from
+        // block, the start for the ones that are fewer steps from it
+        const size_t levels = std::max<size_t>(std::bit_width(order.size()), 1);
+        std::vector<BlockId> up(levels * size, 0);
+        const auto common_dominator = [&](BlockId a, BlockId b)
+        {
+            if (depth[a] < depth[b])
+            {
+                std::swap(a, b);
+            }
+            for (uint32_t steps = depth[a] - depth[b], level = 0; steps != 0; steps >>= 1, level++)
+            {
+                if ((steps & 1) != 0)
+                {
+                    a = up[level * size + a];
+                }
+            }
+            if (a == b)
+            {
+                return a;
+            }
+            for (size_t level = levels; level-- > 0;)
+            {
+                if (up[level * size + a] != up[level * size + b])
+                {
+                    a = up[level * size + a];
+                    b = up[level * size + b];
+                }
+            }
+            return up[a];
+        };
+        for (const BlockId block : order)
+        {
+            if (block == 0)
+            {
+                continue;
+            }
+            BlockId dom = no_block;
+            for (const BlockId pred : preds[block])
+            {
+                assert((rank[pred] == UINT32_MAX || rank[pred] < rank[block]) && "dominators need a CFG without cycles");
+                if (idom[pred] != no_block)
+                {
+                    dom = dom == no_block ? pred : common_dominator(dom, pred);
+                }
+            }
+            idom[block] = dom;
+            depth[block] = depth[dom] + 1;
+            up[block] = dom;
+            for (size_t level = 1; level < levels; level++)
+            {
+                up[level * size + block] = up[(level - 1) * size + up[(level - 1) * size + block]];
+            }
+        }
+
+        tree.children.resize(size);
+        for (const BlockId block : order)
+        {
+            if (block != 0)
+            {
+                tree.children[idom[block]].push_back(block);
+            }
+        }
+        tree.enter.assign(size, UINT32_MAX);
+        tree.leave.assign(size, 0);
+        uint32_t clock = 0;
+        std::vector<std::pair<BlockId, bool>> walk{{0, false}};
+        while (!walk.empty())
+        {
+            const auto [block, done] = walk.back();
+            walk.pop_back();
+            if (done)
+            {
+                tree.leave[block] = clock++;
+                continue;
+            }
+            tree.enter[block] = clock++;
+            walk.push_back({block, true});
+            for (const BlockId child : tree.children[block])
+            {
+                walk.push_back({child, false});
+            }
+        }
+        return tree;
+    }
+
+    [[nodiscard]] bool reachable(const BlockId block) const
+    {
+        return idom[block] != no_block;
+    }
+
+    [[nodiscard]] bool dominates(const BlockId dom, const BlockId block) const
+    {
+        return enter[dom] <= enter[block] && leave[block] <= leave[dom];
+    }
+};
+
+// Analyses passes share, each is worked out the first time a pass asks
+// for it and kept until a pass changes what it is worked out from
+// They all only look at the blocks and the edges between them
+class IrAnalyses
+{
+public:
+    inline explicit IrAnalyses(const IrProg &ir)
+        : m_ir(ir)
+    {
+    }
+
+    [[nodiscard]] inline const std::vector<std::vector<BlockId>> &predecessors()
+    {
+        if (!m_preds.has_value())
+        {
+            m_preds = m_ir.predecessors();
+        }
+        return m_preds.value();
+    }
+
+    [[nodiscard]] inline const std::vector<BlockId> &reverse_post_order()
+    {
+        if (!m_order.has_value())
+        {
+            m_order = m_ir.reverse_post_order();
+        }
+        return m_order.value();
+    }
+
+    [[nodiscard]] inline const DominatorTree &dominators()
+    {
+        if (!m_dominators.has_value())
+        {
+            m_dominators = DominatorTree::build(predecessors(), reverse_post_order());
+        }
+        return m_dominators.value();
+    }
+
+    // after a pass changed the blocks or the edges between them
+    inline void invalidate_cfg()
+    {
+        m_preds.reset();
+        m_order.reset();
+        m_dominators.reset();
+    }
+
+private:
+    const IrProg &m_ir;
+    std::optional<std::vector<std::vector<BlockId>>> m_preds;
+    std::optional<std::vector<BlockId>> m_order;
+    std::optional<DominatorTree> m_dominators;
+};
+
+inline std::string_view op_name(const IrOp op)
+{
+    switch (op)
+    {
+    case IrOp::const_:
+        return "const";
+    case IrOp::add:
+        return "add";
+    case IrOp::sub:
+        return "sub";
+    case IrOp::mul:
+        return "mul";
+    case IrOp::div:
+        return "div";
+    case IrOp::jump:
+        return "jump";
+    case IrOp::branch:
+        return "branch";
+    case IrOp::exit:
+        return "exit";
+    }
+    return "?";
+}
+
+// Text form of the IR, one instruction per line:
+//   block1:            ; preds block0
+//       %3:u8 = add %1, %2 !overflow
+//       branch %3, block2, block3
+inline std::string dump_ir(const IrProg &ir)
+{
+    std::stringstream out;
+    const std::vector<std::vector<BlockId>> preds = ir.predecessors();
+    const auto vreg = [](const uint32_t value)
+    { return "%" + std::to_string(value); };
+    const auto block_name = [](const uint32_t block)
+    { return "block" + std::to_string(block); };
+    for (BlockId block = 0; block < ir.blocks.size(); block++)
+    {
+        out << block_name(block) << ":";
+        if (!preds[block].empty())
+        {
+            out << "  ; preds";
+            for (const BlockId pred : preds[block])
+            {
+                out << " " << block_name(pred);
+            }
+        }
+        out << "\n";
+        for (const Inst &inst : ir.blocks[block].insts)
+        {
+            out << "    ";
+            if (inst.dst != no_vreg)
+            {
+                out << vreg(inst.dst) << ":" << type_name(inst.type) << " = ";
+            }
+            out << op_name(inst.op);
+            switch (inst.op)
+            {
+            case IrOp::const_:
+            {
+                const uint64_t value = IrProg::const_value(inst);
+                if (is_signed(inst.type))
+                {
+                    out << " " << static_cast<int64_t>(value);
+                }
+                else
+                {
+                    out << " " << value;
+                }
+                break;
+            }
+            case IrOp::jump:
+                out << " " << block_name(inst.a);
+                break;
+            case IrOp::branch:
+                out << " " << vreg(inst.a) << ", " << block_name(inst.b) << ", " << block_name(inst.c);
+                break;
+            case IrOp::exit:
+                out << " " << vreg(inst.a);
+                break;
+            default:
+                out << " " << vreg(inst.a) << ", " << vreg(inst.b);
+                if ((inst.checks & check_overflow) != 0)
+                {
+                    out << " !overflow";
+                }
+                if ((inst.checks & check_zero) != 0)
+                {
+                    out << " !zero";
+                }
+                break;
+            }
+            out << "\n";
+        }
+    }
+    return out.str();
+}
+
+// The first thing wrong with ir, if anything is:
+// every block ends in its only terminator and targets exist, the blocks
+// that can be reached form no cycle, every vreg is defined once,
+// operands have the type of their instruction, and (in blocks that can
+// be reached) every use is dominated by its definition
+// The analyses are only asked for once the blocks and their targets
+// check out, see PassManager::run for why they are passed in
+inline std::optional<std::string> verify_ir(const IrProg &ir, IrAnalyses &analyses)
+{
+    const auto where = [](const BlockId block, const size_t index)
+    { return "block" + std::to_string(block) + " instruction " + std::to_string(index) + ": "; };
+    if (ir.blocks.empty())
+    {
+        return "no blocks";
+    }
+
+    // where each vreg is defined
+    std::vector<std::pair<BlockId, uint32_t>> defs(ir.vreg_count, {no_block, 0});
+    std::vector<IntType> types(ir.vreg_count, IntType::none);
+    for (BlockId block = 0; block < ir.blocks.size(); block++)
+    {
+        const std::vector<Inst> &insts = ir.blocks[block].insts;
+        if (insts.empty() || !is_terminator(insts.back().op))
+        {
+            return "block" + std::to_string(block) + " does not end in a terminator";
+        }
+        for (uint32_t i = 0; i < insts.size(); i++)
+        {
+            const Inst &inst = insts[i];
+            if (is_terminator(inst.op) != (i + 1 == insts.size()))
+            {
+                return where(block, i) + "terminator in the middle of the block";
+            }
+            if ((inst.op == IrOp::jump && inst.a >= ir.blocks.size()) ||
+                (inst.op == IrOp::branch && (inst.b >= ir.blocks.size() || inst.c >= ir.blocks.size())))
+            {
+                return where(block, i) + "target block does not exist";
+            }
+            if ((inst.dst == no_vreg) != is_terminator(inst.op))
+            {
+                return where(block, i) + (is_terminator(inst.op) ? "terminator with a result" : "no result");
+            }
+            if (inst.dst == no_vreg)
+            {
+                continue;
+            }
+            if (inst.dst >= ir.vreg_count)
+            {
+                return where(block, i) + "vreg out of range";
+            }
+            if (defs[inst.dst].first != no_block)
+            {
+                return where(block, i) + "%" + std::to_string(inst.dst) + " is defined twice";
+            }
+            if (inst.type == IntType::none)
+            {
+                return where(block, i) + "no type";
+            }
+            defs[inst.dst] = {block, i};
+            types[inst.dst] = inst.type;
+        }
+    }
+
+    const std::vector<BlockId> &order = analyses.reverse_post_order();
+    std::vector<uint32_t> rank(ir.blocks.size(), UINT32_MAX);
+    for (uint32_t i = 0; i < order.size(); i++)
+    {
+        rank[order[i]] = i;
+    }
+    for (const BlockId block : order)
+    {
+        for (const BlockId succ : ir.successors(block))
+        {
+            if (rank[succ] <= rank[block])
+            {
+                return "block" + std::to_string(block) + " goes back to block" + std::to_string(succ) + ", the CFG has a cycle";
+            }
+        }
+    }
+    const DominatorTree &tree = analyses.dominators();
+    for (BlockId block = 0; block < ir.blocks.size(); block++)
+    {
+        const bool reachable = tree.reachable(block);
+        const std::vector<Inst> &insts = ir.blocks[block].insts;
+        for (uint32_t i = 0; i < insts.size(); i++)
+        {
+            const Inst &inst = insts[i];
+            // value used by this instruction, operands have its type
+            const auto check_use = [&](const VReg value) -> std::optional<std::string>
+            {
+                if (value >= ir.vreg_count || defs[value].first == no_block)
+                {
+                    return where(block, i) + "%" + std::to_string(value) + " is never defined";
+                }
+                if (types[value] != inst.type)
+                {
+                    return where(block, i) + "%" + std::to_string(value) + " is " + std::string(type_name(types[value])) +
+                           ", expected " + std::string(type_name(inst.type));
+                }
+                const auto [def_block, def_index] = defs[value];
+                if (reachable && (def_block == block ? def_index >= i : !tree.dominates(def_block, block)))
+                {
+                    return where(block, i) + "%" + std::to_string(value) + " is used where its definition does not dominate";
+                }
+                return {};
+            };
+            std::optional<std::string> problem;
+            switch (inst.op)
+            {
+            case IrOp::const_:
+                if (wrap_to(IrProg::const_value(inst), inst.type) != IrProg::const_value(inst))
+                {
+                    return where(block, i) + "constant does not fit its type";
+                }
+                break;
+            case IrOp::jump:
+                break;
+            case IrOp::branch:
+            case IrOp::exit:
+                problem = check_use(inst.a);
+                break;
+            default:
+                if (inst.type == IntType::bool_)
+                {
+                    return where(block, i) + "arithmetic on bool";
+                }
+                if (!(problem = check_use(inst.a)))
+                {
+                    problem = check_use(inst.b);
+                }
+                break;
+            }
+            if (problem)
+            {
+                return problem;
+            }
+        }
+    }
+    return {};
+}
+
+inline std::optional<std::string> verify_ir(const IrProg &ir)
+{
+    IrAnalyses analyses(ir);
+    return verify_ir(ir, analyses);
+}
+
+// Stops the compiler with the problem and the IR if ir is malformed
+inline void check_ir(const IrProg &ir, IrAnalyses &analyses)
+{
+    if (const std::optional<std::string> problem = verify_ir(ir, analyses))
+    {
+        std::cerr << "Invalid IR: " << problem.value() << "\n"
+                  << dump_ir(ir);
+        abort();
+    }
+}
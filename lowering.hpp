@@ -0,0 +1,342 @@
+#pragma once
+#include <cassert>
+#include <vector>
+#include "./ir.hpp"
+#include "./parser.hpp"
+#include "./ranges.hpp"
+#include "./typecheck.hpp"
+
+// Turns a NodeProg into IR
+// Variables are never assigned again after their let, so a variable is
+// just the vreg of its initial value and reading it costs nothing. Scopes
+// only limit which names are visible, they leave no trace in the IR
+// An if chain becomes a branch per condition, with the scopes in blocks
+// of their own that all go on to one block after the chain. Like in
+// Generator, conditions known at compile time pick their scope directly
+class IrLowering
+{
+public:
+    inline IrLowering(const NodeProg &prog, const SymbolTable &symbols)
+        : m_prog(prog),
+          m_checker(symbols)
+    {
+    }
+
+    // Arithmetic that might overflow or divide by zero gets checks, see
+    // Generator::checked_arithmetic
+    inline void checked_arithmetic()
+    {
+        m_checked = true;
+        m_checker.checked_arithmetic();
+    }
+
+    [[nodiscard]] inline IrProg lower()
+    {
+        m_infos = m_checker.check(m_prog);
+        m_current = m_ir.add_block();
+        for (const NodeIndex stmt : m_prog.stmts)
+        {
+            lower_stmt(stmt);
+        }
+        // if our program does not have an exit statement than exit with zero
+        const VReg zero = emit_const(default_int_type, 0);
+        terminate({.op = IrOp::exit, .type = default_int_type, .a = zero});
+        return std::move(m_ir);
+    }
+
+private:
+    // Same walk as Generator::gen_stmt, with blocks where it has labels
+    inline void lower_stmt(const NodeIndex stmt)
+    {
+        const size_t base = m_work.size();
+        m_work.push_back({.op = Work::Op::stmt, .node = stmt});
+        while (m_work.size() > base)
+        {
+            const Work work = m_work.back();
+            m_work.pop_back();
+            switch (work.op)
+            {
+            case Work::Op::stmt:
+                lower_stmt_node(work.node);
+                break;
+            case Work::Op::end_scope:
+                end_scope();
+                break;
+            case Work::Op::branch:
+                lower_branch(work.node, work.join);
+                break;
+            case Work::Op::branch_end:
+                // skip the rest of the chain
+                terminate({.op = IrOp::jump, .a = work.join});
+                m_current = work.block;
+                m_work.push_back({.op = Work::Op::branch, .node = m_prog[work.node].c, .join = work.join});
+                break;
+            case Work::Op::enter:
+                terminate({.op = IrOp::jump, .a = work.block});
+                m_current = work.block;
+                break;
+            }
+        }
+    }
+
+    inline void lower_stmt_node(const NodeIndex stmt)
+    {
+        const Node &node = m_prog[stmt];
+        const ExprInfo &info = m_infos[stmt];
+        switch (node.kind)
+        {
+        case NodeKind::stmt_exit:
+        {
+            const VReg value = info.constant ? emit_const(info.type, info.value) : lower_expr(node.a, info.type).first;
+            terminate({.op = IrOp::exit, .type = info.type, .a = value});
+            // anything after the exit can't be reached but still gets lowered
+            m_current = m_ir.add_block();
+            break;
+        }
+        case NodeKind::stmt_let:
+            if (info.constant)
+            {
+                bind(node.a, {.vreg = emit_const(info.type, info.value), .range = Interval::point_of(info.value, info.type)});
+            }
+            else
+            {
+                const auto [vreg, range] = lower_expr(node.b, info.type);
+                bind(node.a, {.vreg = vreg, .range = range});
+            }
+            break;
+        case NodeKind::stmt_const:
+            bind(node.a, {.is_const = true, .type = info.type, .value = info.value});
+            break;
+        case NodeKind::stmt_scope:
+        {
+            m_scopes.push_back(m_names.size());
+            m_work.push_back({.op = Work::Op::end_scope});
+            const std::span<const NodeIndex> stmts = m_prog.scope_stmts(node);
+            for (auto it = stmts.rbegin(); it != stmts.rend(); ++it)
+            {
+                m_work.push_back({.op = Work::Op::stmt, .node = *it});
+            }
+            break;
+        }
+        case NodeKind::stmt_if:
+            lower_branch(stmt, no_block);
+            break;
+        default:
+            assert(false && "not a statement");
+        }
+    }
+
+    // One link of an if chain, see Generator::gen_branch
+    // A false condition goes on to the block of the next link, a taken
+    // scope goes to join, the block after the chain, which the first
+    // link that needs it makes
+    inline void lower_branch(const NodeIndex branch, BlockId join)
+    {
+        const Node &node = m_prog[branch];
+        if (node.kind == NodeKind::if_pred_else)
+        {
+            m_work.push_back({.op = Work::Op::stmt, .node = node.b});
+            return;
+        }
+        const ExprInfo &info = m_infos[branch];
+        if (info.constant)
+        {
+            if (info.value != 0)
+            {
+                m_work.push_back({.op = Work::Op::stmt, .node = node.b});
+            }
+            else if (node.c != no_node)
+            {
+                m_work.push_back({.op = Work::Op::branch, .node = node.c, .join = join});
+            }
+            return;
+        }
+
+        const VReg condition = lower_expr(node.a, info.type).first;
+        const BlockId taken = m_ir.add_block();
+        const BlockId next = m_ir.add_block();
+        terminate({.op = IrOp::branch, .type = info.type, .a = condition, .b = taken, .c = next});
+        if (node.c == no_node)
+        {
+            m_work.push_back({.op = Work::Op::enter, .block = next});
+        }
+        else
+        {
+            if (join == no_block)
+            {
+                join = m_ir.add_block();
+                m_work.push_back({.op = Work::Op::enter, .block = join});
+            }
+            m_work.push_back({.op = Work::Op::branch_end, .node = branch, .block = next, .join = join});
+        }
+        m_current = taken;
+        m_work.push_back({.op = Work::Op::stmt, .node = node.b});
+    }
+
+    // Post order walk like Generator::gen_expr, the vregs of the operands
+    // and their value ranges are kept on stacks
+    // Returns the vreg of the value and its range
+    inline std::pair<VReg, Interval> lower_expr(const NodeIndex expr, const IntType type)
+    {
+        m_expr_stack.push_back({expr, false});
+        while (!m_expr_stack.empty())
+        {
+            const auto [index, operands_done] = m_expr_stack.back();
+            m_expr_stack.pop_back();
+            const Node &node = m_prog[index];
+            if (node.kind == NodeKind::term_int_lit)
+            {
+                const auto value = wrap_to(static_cast<uint64_t>(m_prog.int_value(node)), type);
+                m_values.push_back({emit_const(type, value), Interval::point_of(value, type)});
+            }
+            else if (node.kind == NodeKind::term_ident)
+            {
+                const Value &bound = m_bindings[node.a];
+                if (bound.is_const)
+                {
+                    // an untyped const is a u64 that fits type, see TypeChecker
+                    const uint64_t value = wrap_to(bound.value, type);
+                    m_values.push_back({emit_const(type, value), Interval::point_of(value, type)});
+                }
+                else
+                {
+                    m_values.push_back({bound.vreg, bound.range});
+                }
+            }
+            else if (!operands_done)
+            {
+                m_expr_stack.push_back({index, true});
+                m_expr_stack.push_back({node.b, false});
+                m_expr_stack.push_back({node.a, false});
+            }
+            else
+            {
+                const auto [rhs, rhs_range] = m_values.back();
+                m_values.pop_back();
+                const auto [lhs, lhs_range] = m_values.back();
+                const OpRange range = op_range(node.kind, lhs_range, rhs_range, type, m_checked);
+                uint8_t checks = 0;
+                if (m_checked && range.may_overflow)
+                {
+                    checks |= check_overflow;
+                }
+                if (m_checked && range.may_divide_by_zero)
+                {
+                    checks |= check_zero;
+                }
+                const VReg dst = m_ir.new_vreg();
+                emit({.op = ir_op(node.kind), .type = type, .checks = checks, .dst = dst, .a = lhs, .b = rhs});
+                m_values.back() = {dst, range.result};
+            }
+        }
+        const std::pair<VReg, Interval> value = m_values.back();
+        m_values.pop_back();
+        return value;
+    }
+
+    static inline IrOp ir_op(const NodeKind kind)
+    {
+        switch (kind)
+        {
+        case NodeKind::bin_add:
+            return IrOp::add;
+        case NodeKind::bin_sub:
+            return IrOp::sub;
+        case NodeKind::bin_multi:
+            return IrOp::mul;
+        default:
+            return IrOp::div;
+        }
+    }
+
+    inline void emit(const Inst &inst)
+    {
+        m_ir.blocks[m_current].insts.push_back(inst);
+    }
+
+    inline VReg emit_const(const IntType type, const uint64_t value)
+    {
+        const VReg dst = m_ir.new_vreg();
+        emit(IrProg::constant(dst, type, value));
+        return dst;
+    }
+
+    // ends the current block, the caller says which one comes next
+    inline void terminate(const Inst &terminator)
+    {
+        emit(terminator);
+        m_current = no_block;
+    }
+
+    // what a name stands for: the vreg of a variable, the value of a const
+    struct Value
+    {
+        bool is_const = false;
+        VReg vreg = no_vreg;
+        // what the variable can hold, see op_range
+        Interval range;
+        // of consts, untyped ones as u64
+        IntType type = IntType::none;
+        uint64_t value = 0;
+    };
+
+    inline void bind(const Symbol name, const Value &value)
+    {
+        if (name >= m_bindings.size())
+        {
+            m_bindings.resize(std::max<size_t>(name + 1, m_bindings.size() * 2));
+        }
+        m_bindings[name] = value;
+        m_names.push_back(name);
+    }
+
+    inline void end_scope()
+    {
+        for (size_t i = m_scopes.back(); i < m_names.size(); i++)
+        {
+            m_bindings[m_names[i]] = {};
+        }
+        m_names.resize(m_scopes.back());
+        m_scopes.pop_back();
+    }
+
+    const NodeProg &m_prog;
+    TypeChecker m_checker;
+    bool m_checked = false;
+    // by statement NodeIndex, see Generator::m_infos
+    std::vector<ExprInfo> m_infos;
+    IrProg m_ir;
+    // where instructions go, no_block right after a terminator
+    BlockId m_current = no_block;
+    // by Symbol, what the name stands for in the current scope
+    // TypeChecker already reported names that are used before they are
+    // declared, see Generator::m_var_slots for why one slot is enough
+    std::vector<Value> m_bindings;
+    // names in the order they were bound, and where each open scope starts
+    std::vector<Symbol> m_names;
+    std::vector<size_t> m_scopes;
+
+    // what is left to do for the statements being lowered
+    struct Work
+    {
+        enum class Op : uint8_t
+        {
+            // lower the statement in node
+            stmt,
+            end_scope,
+            // lower the if chain link in node, taken links go to join
+            branch,
+            // after the scope of the if or elif in node: jump to join and
+            // go on with the next link in block
+            branch_end,
+            // jump to block and go on there
+            enter,
+        } op;
+        NodeIndex node = no_node;
+        BlockId block = no_block;
+        BlockId join = no_block;
+    };
+    std::vector<Work> m_work;
+    std::vector<std::pair<NodeIndex, bool>> m_expr_stack;
+    std::vector<std::pair<VReg, Interval>> m_values;
+};
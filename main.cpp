@@ -1,58 +1,410 @@
-#include <fstream>
-#include <iostream>
-#include <sstream>
-#include <vector>
-#include "./generation.hpp"
-
-// Taking Cmd Args Of Custom Lang File
-int main(int argc, char *argv[])
-{
-    if (argc != 2)
-    {
-        std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-        std::cerr << "a.out <Aski.al>" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // Reading the file and converting it to string
-    std::string contents;
-    {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
-    }
-
-    // Tokenizing using tokenizer and getting back tokens
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> tokens = tokenizer.tokenize();
-
-    // the tokens which return from tokenizer are passed to parser
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> Prog = parser.parseProg();
-
-    // if Program is valider than only go ahead
-    // or else throw error
-    if (!Prog.has_value())
-    {
-
-        std::cerr << "INVALID PROGRAM" << std::endl;
-
-        exit(EXIT_FAILURE);
-    }
-
-    // Generate will generate the al to asm code
-    // And will create out.asm file
-    {
-        Generator generator(Prog.value());
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
-    }
-
-    // Compiling the asm file and linking
-    // and generating the object file(machine code)
-    system("nasm -felf64 out.asm");
-    system("ld -o out out.o");
-
-    return EXIT_SUCCESS;
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "./ast_cache.hpp"
+#include "./backend.hpp"
+#include "./generation.hpp"
+#include "./incremental.hpp"
+#include "./lowering.hpp"
+#include "./parallel_parsing.hpp"
+#include "./parallel_tokenization.hpp"
+#include "./passes.hpp"
+#include "./pipeline.hpp"
+#include "./source.hpp"
+
+static void usage()
+{
+    std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
+    std::cerr << "a.out [options] <Aski.al>" << std::endl;
+    std::cerr << "a.out [options] -        (read the program from stdin)" << std::endl;
+    std::cerr << "options:" << std::endl;
+    std::cerr << "  -j<n>    lex and parse with n threads (default: all cores)" << std::endl;
+    std::cerr << "  -O0      generate straight from the AST, the fastest to compile" << std::endl;
+    std::cerr << "           (only expressions that are constant as a whole get folded," << std::endl;
+    std::cerr << "           not constant parts like the 2 * 3 in x + 2 * 3)" << std::endl;
+    std::cerr << "  -O1      generate through the IR and tidy it up first (default)" << std::endl;
+    std::cerr << "  -O2      also drop repeated computations" << std::endl;
+    std::cerr << "  --passes=<pass,...>" << std::endl;
+    std::cerr << "           run these IR passes instead of the ones of the -O level, out of" << std::endl;
+    std::cerr << "           const-fold, simplify-cfg, cse and dce" << std::endl;
+    std::cerr << "  --time-passes" << std::endl;
+    std::cerr << "           print how long each pass took and how it changed the IR size" << std::endl;
+    std::cerr << "  --watch  rebuild whenever the file changes" << std::endl;
+    std::cerr << "  --pipeline" << std::endl;
+    std::cerr << "           lex, parse and generate at the same time on three threads" << std::endl;
+    std::cerr << "           (generates like -O0)" << std::endl;
+    std::cerr << "  --share-exprs" << std::endl;
+    std::cerr << "           identical expressions share one AST node" << std::endl;
+    std::cerr << "  --checked" << std::endl;
+    std::cerr << "           trap on arithmetic overflow and division by zero" << std::endl;
+    std::cerr << "  --emit-ir" << std::endl;
+    std::cerr << "           also write the IR the asm is made from to out.ir" << std::endl;
+    std::cerr << "           (not with -O0 or --pipeline, which don't make any)" << std::endl;
+    std::cerr << "  --verify-ir" << std::endl;
+    std::cerr << "           check the IR after lowering and after every pass, for debugging" << std::endl;
+    std::cerr << "           the compiler (same restrictions as --emit-ir)" << std::endl;
+    std::cerr << "  --cache-dir=<dir>" << std::endl;
+    std::cerr << "           reuse the parsed program of unchanged files from dir" << std::endl;
+    std::cerr << "           (default: $ASKI_CACHE_DIR, no caching if unset)" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+// Compiling the asm file and linking
+// and generating the object file(machine code)
+static void assemble()
+{
+    system("nasm -felf64 out.asm");
+    system("ld -o out out.o");
+}
+
+// what to build, from the command line
+struct BuildOptions
+{
+    bool checked = false;
+    bool emit_ir = false;
+    bool verify_ir = false;
+    bool time_passes = false;
+    // the IR passes, none at all for -O0 which generates straight from the AST
+    std::optional<PassManager::Pipeline> passes = PassManager::preset(1);
+};
+
+// Generates the asm for the prog, through the IR unless it is -O0
+// And will create out.asm file
+// Then compiles the asm file and links it
+static void build(const NodeProg &prog, const SymbolTable &symbols, const BuildOptions &options)
+{
+    {
+        PassTimings timings;
+        PassTimings *const timed = options.time_passes ? &timings : nullptr;
+        std::string output;
+        auto start = PassTimings::Clock::now();
+        if (!options.passes.has_value())
+        {
+            Generator generator(prog, symbols);
+            if (options.checked)
+            {
+                generator.checked_arithmetic();
+            }
+            output = generator.gen_prog();
+            if (timed != nullptr)
+            {
+                timings.add("generate", start, {}, {});
+            }
+        }
+        else
+        {
+            IrLowering lowering(prog, symbols);
+            if (options.checked)
+            {
+                lowering.checked_arithmetic();
+            }
+            IrProg ir = lowering.lower();
+            if (timed != nullptr)
+            {
+                timings.add("lower", start, IrSize{}, ir_size(ir));
+            }
+            PassManager manager(options.passes.value());
+            if (options.verify_ir)
+            {
+                manager.verify_each_pass();
+            }
+            manager.run(ir, timed);
+            if (options.emit_ir)
+            {
+                std::fstream ir_file("out.ir", std::ios::out);
+                ir_file << dump_ir(ir);
+            }
+            start = PassTimings::Clock::now();
+            output = X86Backend(ir).gen_prog();
+            if (timed != nullptr)
+            {
+                timings.add("x86", start, {}, {});
+            }
+        }
+        std::fstream file("out.asm", std::ios::out);
+        file << output;
+        if (timed != nullptr)
+        {
+            timings.print();
+        }
+    }
+    assemble();
+}
+
+static bool modified_time(const char *path, timespec &time)
+{
+    struct stat st{};
+    if (stat(path, &st) != 0)
+    {
+        return false;
+    }
+    time = st.st_mtim;
+    return true;
+}
+
+// build that reports a mistake in the program instead of exiting
+static bool try_build(const NodeProg &prog, const SymbolTable &symbols, const BuildOptions &options)
+{
+    try
+    {
+        build(prog, symbols, options);
+        return true;
+    }
+    catch (const CompileError &error)
+    {
+        std::cerr << error.what() << std::endl;
+        return false;
+    }
+}
+
+// Rebuilds every time path changes, the change is found by comparing
+// the old and new text so only the statements around it get parsed again
+// A save with a mistake in it is reported and the next one is compared
+// with the last text that parsed
+[[noreturn]] static void watch(const char *path, const BuildOptions &options)
+{
+    SymbolTable symbols;
+    IncrementalParser parser(symbols);
+    timespec last{};
+    modified_time(path, last);
+    if (parser.parse(std::string(SourceFile(path).view())))
+    {
+        try_build(parser.prog(), symbols, options);
+    }
+    while (true)
+    {
+        usleep(200 * 1000);
+        timespec now{};
+        // editors that save by renaming leave the file missing for a moment
+        if (!modified_time(path, now) || (now.tv_sec == last.tv_sec && now.tv_nsec == last.tv_nsec))
+        {
+            continue;
+        }
+        last = now;
+
+        const std::string text(SourceFile(path).view());
+        const std::string_view old = parser.source();
+        const size_t max_common = std::min(old.size(), text.size());
+        size_t prefix = 0;
+        while (prefix < max_common && old[prefix] == text[prefix])
+        {
+            prefix++;
+        }
+        size_t suffix = 0;
+        while (suffix < max_common - prefix && old[old.size() - 1 - suffix] == text[text.size() - 1 - suffix])
+        {
+            suffix++;
+        }
+        const std::string_view replacement = std::string_view(text).substr(prefix, text.size() - suffix - prefix);
+        if (parser.edit(prefix, old.size() - suffix, replacement) && try_build(parser.prog(), symbols, options))
+        {
+            std::cerr << "Rebuilt " << path << std::endl;
+        }
+    }
+}
+
+// Taking Cmd Args Of Custom Lang File
+// A mistake in the program ends up in the catch at the bottom, see
+// CompileError
+int main(int argc, char *argv[])
+try
+{
+    const char *path = nullptr;
+    size_t threads = default_thread_count();
+    bool watching = false;
+    bool share_exprs = false;
+    bool pipelined = false;
+    BuildOptions options;
+    int opt_level = 1;
+    const char *pass_list = nullptr;
+    const char *cache_dir = std::getenv("ASKI_CACHE_DIR");
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string_view arg = argv[i];
+        if (arg.size() > 2 && arg.substr(0, 2) == "-j")
+        {
+            threads = std::max(1, std::atoi(argv[i] + 2));
+        }
+        else if (arg == "-O0" || arg == "-O1" || arg == "-O2")
+        {
+            opt_level = arg[2] - '0';
+        }
+        else if (arg.starts_with("--passes="))
+        {
+            pass_list = argv[i] + std::string_view("--passes=").size();
+        }
+        else if (arg == "--time-passes")
+        {
+            options.time_passes = true;
+        }
+        else if (arg == "--watch")
+        {
+            watching = true;
+        }
+        else if (arg == "--pipeline")
+        {
+            pipelined = true;
+        }
+        else if (arg == "--share-exprs")
+        {
+            share_exprs = true;
+        }
+        else if (arg == "--checked")
+        {
+            options.checked = true;
+        }
+        else if (arg == "--verify-ir")
+        {
+            options.verify_ir = true;
+        }
+        else if (arg == "--emit-ir")
+        {
+            options.emit_ir = true;
+        }
+        else if (arg.starts_with("--cache-dir="))
+        {
+            cache_dir = argv[i] + std::string_view("--cache-dir=").size();
+        }
+        else if (path == nullptr && (arg == "-" || arg.front() != '-'))
+        {
+            path = argv[i];
+        }
+        else
+        {
+            usage();
+        }
+    }
+    if (pass_list != nullptr)
+    {
+        options.passes = PassManager::parse(pass_list);
+        if (!options.passes.has_value())
+        {
+            std::cerr << "Unknown pass in --passes=" << pass_list << ", the passes are";
+            for (const IrPass &pass : ir_passes)
+            {
+                std::cerr << " " << pass.name;
+            }
+            std::cerr << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (opt_level == 0)
+    {
+        options.passes.reset();
+    }
+    else
+    {
+        options.passes = PassManager::preset(opt_level);
+    }
+    const bool uses_ir = options.emit_ir || options.verify_ir;
+    if (path == nullptr || (uses_ir && !options.passes.has_value()) || (pipelined && (uses_ir || pass_list != nullptr)))
+    {
+        usage();
+    }
+
+    const bool from_stdin = std::string_view(path) == "-";
+    if (watching)
+    {
+        if (from_stdin)
+        {
+            usage();
+        }
+        watch(path, options);
+    }
+
+    // Reading from stdin streams the input, the parser pulls tokens from the
+    // tokenizer as it goes and the tokenizer reads fixed size chunks
+    // (the symbol table keeps its own copy of the identifier text).
+    // Otherwise the file is mapped into memory and the symbol table points
+    // into that buffer (or into the cache entry) so it has to stay alive
+    // until the asm is written
+    std::optional<AstCache> cache;
+    std::optional<SourceFile> source;
+    SymbolTable symbols;
+
+    // the whole program never exists at once in this mode, so it can't be
+    // cached or lowered to IR, it is generated straight from the AST
+    if (pipelined)
+    {
+        std::optional<Tokenizer> tokenizer;
+        if (from_stdin)
+        {
+            tokenizer.emplace(STDIN_FILENO, symbols);
+        }
+        else
+        {
+            source.emplace(path);
+            tokenizer.emplace(source->view(), symbols);
+        }
+        // the asm is streamed into a temporary file that only replaces
+        // out.asm once every stage succeeded, like the other modes an error
+        // leaves no half written out.asm behind
+        {
+            std::fstream file("out.asm.tmp", std::ios::out);
+            try
+            {
+                compile_pipelined(tokenizer.value(), symbols, share_exprs, options.checked, file);
+            }
+            catch (...)
+            {
+                file.close();
+                std::remove("out.asm.tmp");
+                throw;
+            }
+        }
+        std::rename("out.asm.tmp", "out.asm");
+        assemble();
+        return EXIT_SUCCESS;
+    }
+
+    std::optional<NodeProg> Prog;
+    if (from_stdin)
+    {
+        // the tokens which return from tokenizer are passed to parser
+        Tokenizer tokenizer(STDIN_FILENO, symbols);
+        Parser parser(tokenizer);
+        if (share_exprs)
+        {
+            parser.share_exprs();
+        }
+        Prog = parser.parseProg();
+    }
+    else
+    {
+        source.emplace(path);
+        if (cache_dir != nullptr && *cache_dir != '\0')
+        {
+            cache.emplace(cache_dir, share_exprs ? 1 : 0);
+            Prog = cache->load(source->view(), symbols);
+        }
+        if (!Prog.has_value())
+        {
+            Prog = ParallelParser(ParallelTokenizer(source->view(), symbols, threads).tokenize(), threads, share_exprs).parseProg();
+            if (cache.has_value() && Prog.has_value())
+            {
+                cache->store(source->view(), Prog.value(), symbols);
+            }
+        }
+    }
+
+    // if Program is valider than only go ahead
+    // or else throw error
+    if (!Prog.has_value())
+    {
+
+        std::cerr << "INVALID PROGRAM" << std::endl;
+
+        exit(EXIT_FAILURE);
+    }
+
+    build(Prog.value(), symbols, options);
+
+    return EXIT_SUCCESS;
+}
+catch (const CompileError &error)
+{
+    std::cerr << error.what() << std::endl;
+    return EXIT_FAILURE;
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs fn(0) .. fn(count - 1) on up to count threads (the calling thread
+// takes the first one) and waits for all of them
+// Whatever one of them throws is rethrown on the calling thread once they
+// are all done, the one of the lowest i if several do, which is the one a
+// serial loop would have run into first
+template <typename Fn>
+inline void parallel_for(const size_t count, Fn fn)
+{
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    size_t error_index = count;
+    const auto run = [&](const size_t i)
+    {
+        try
+        {
+            fn(i);
+        }
+        catch (...)
+        {
+            const std::lock_guard lock(error_mutex);
+            if (i < error_index)
+            {
+                error = std::current_exception();
+                error_index = i;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(count > 0 ? count - 1 : 0);
+    for (size_t i = 1; i < count; i++)
+    {
+        workers.emplace_back(run, i);
+    }
+    if (count > 0)
+    {
+        run(0);
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+// Lock free queue between exactly one producer and one consumer thread
+// The two ends only share the head and tail counters, push blocks while
+// the ring is full and pop while it is empty (waiting on the counter, so
+// a blocked end sleeps instead of spinning)
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(const size_t capacity)
+        : m_slots(capacity)
+    {
+    }
+
+    void push(T item)
+    {
+        put(std::move(item));
+    }
+
+    // no more pushes after this, pop comes back empty once the ring drains
+    // (and every time after that)
+    void close()
+    {
+        put();
+    }
+
+    std::optional<T> pop()
+    {
+        if (m_ended)
+        {
+            return {};
+        }
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        while (tail == head)
+        {
+            m_tail.wait(tail, std::memory_order_acquire);
+            tail = m_tail.load(std::memory_order_acquire);
+        }
+        std::optional<T> item = std::move(m_slots[head % m_slots.size()]);
+        m_ended = !item.has_value();
+        m_head.store(head + 1, std::memory_order_release);
+        m_head.notify_one();
+        return item;
+    }
+
+    // Pops everything up to the end, for a consumer that gave up so the
+    // producer doesn't block on a full ring forever
+    void drain()
+    {
+        while (pop())
+        {
+        }
+    }
+
+private:
+    // puts item in the next slot, or the end marker without one
+    template <typename... Item>
+    void put(Item &&...item)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        while (tail - head == m_slots.size())
+        {
+            m_head.wait(head, std::memory_order_acquire);
+            head = m_head.load(std::memory_order_acquire);
+        }
+        if constexpr (sizeof...(Item) == 0)
+        {
+            m_slots[tail % m_slots.size()].reset();
+        }
+        else
+        {
+            m_slots[tail % m_slots.size()].emplace(std::move(item)...);
+        }
+        m_tail.store(tail + 1, std::memory_order_release);
+        m_tail.notify_one();
+    }
+
+    // an empty slot marks the end
+    std::vector<std::optional<T>> m_slots;
+    // the consumer popped the end already, only it touches this
+    bool m_ended = false;
+    // on separate cache lines so the two ends don't fight over one
+    alignas(64) std::atomic<size_t> m_head = 0;
+    alignas(64) std::atomic<size_t> m_tail = 0;
+};
+
+// number of threads to use when the user didn't ask for a specific count
+inline size_t default_thread_count()
+{
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
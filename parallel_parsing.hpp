@@ -0,0 +1,250 @@
+#pragma once
+#include <algorithm>
+#include <optional>
+#include <vector>
+#include "./parallel.hpp"
+#include "./parser.hpp"
+
+// Splits a token stream at top level statement boundaries and parses the
+// pieces on separate threads, each into a NodeProg of its own
+// Concatenating the pieces gives exactly the NodeProg of a serial parse,
+// the serial parser also lays every top level statement (its nodes and
+// scope lists) out after the one before it
+// Shared expressions (Parser::share_exprs) can point anywhere before
+// them in the prog, so those are always parsed serially
+class ParallelParser
+{
+public:
+    inline ParallelParser(TokenBuffer tokens, const size_t threads, const bool share_exprs = false)
+        : m_tokens(std::move(tokens)),
+          m_threads(share_exprs ? 1 : threads),
+          m_share_exprs(share_exprs)
+    {
+    }
+
+    inline std::optional<NodeProg> parseProg()
+    {
+        split();
+        if (m_pieces.size() < 2)
+        {
+            Parser parser(std::move(m_tokens));
+            if (m_share_exprs)
+            {
+                parser.share_exprs();
+            }
+            return parser.parseProg();
+        }
+
+        // 1. parse every piece on its own
+        parallel_for(m_pieces.size(), [this](const size_t i)
+                     {
+                         Piece &piece = m_pieces[i];
+                         piece.prog = Parser(m_tokens, piece.begin, piece.end).parseProg().value();
+                     });
+
+        // 2. where each piece goes in the combined prog
+        size_t nodes = 0;
+        size_t lists = 0;
+        size_t stmts = 0;
+        for (Piece &piece : m_pieces)
+        {
+            piece.first_node = nodes;
+            piece.first_list = lists;
+            piece.first_stmt = stmts;
+            nodes += piece.prog.nodes.size();
+            lists += piece.prog.lists.size();
+            stmts += piece.prog.stmts.size();
+        }
+
+        // 3. copy everything into place with the indices moved along
+        NodeProg prog;
+        prog.nodes.resize(nodes);
+        prog.lists.resize(lists);
+        prog.stmts.resize(stmts);
+        parallel_for(m_pieces.size(), [this, &prog](const size_t i)
+                     { copy_piece(m_pieces[i], prog); });
+        return prog;
+    }
+
+private:
+    struct Piece
+    {
+        size_t begin;
+        size_t end;
+        NodeProg prog;
+        size_t first_node = 0;
+        size_t first_list = 0;
+        size_t first_stmt = 0;
+    };
+
+    // brace depth over a range of tokens
+    struct Depth
+    {
+        int64_t change = 0;
+        // lowest depth relative to the start of the range
+        int64_t lowest = 0;
+    };
+
+    // Every thread takes an equal share of the tokens and moves its start
+    // up to the next top level statement boundary. The depth each share
+    // starts at comes from chaining the depth changes of the ones before
+    inline void split()
+    {
+        // not worth the threads for small inputs
+        constexpr size_t min_piece = 64 * 1024;
+        const size_t size = m_tokens.size();
+        const size_t count = std::min(m_threads, size / min_piece);
+        if (count < 2)
+        {
+            return;
+        }
+
+        std::vector<Depth> depths(count);
+        parallel_for(count, [&](const size_t i)
+                     { depths[i] = depth(size / count * i, i + 1 == count ? size : size / count * (i + 1)); });
+
+        // unbalanced braces are an error, leave reporting it to the serial
+        // parser so it comes out the same
+        std::vector<int64_t> start_depths(count);
+        int64_t depth = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            start_depths[i] = depth;
+            if (depth + depths[i].lowest < 0)
+            {
+                return;
+            }
+            depth += depths[i].change;
+        }
+        if (depth != 0)
+        {
+            return;
+        }
+
+        std::vector<size_t> starts(count, 0);
+        parallel_for(count - 1, [&](const size_t i)
+                     { starts[i + 1] = next_boundary(size / count * (i + 1), start_depths[i + 1]); });
+        for (size_t i = 0; i < count; i++)
+        {
+            const size_t end = i + 1 == count ? size : starts[i + 1];
+            if (starts[i] < end)
+            {
+                m_pieces.push_back({.begin = starts[i], .end = end});
+            }
+        }
+    }
+
+    [[nodiscard]] inline Depth depth(const size_t begin, const size_t end) const
+    {
+        Depth result;
+        for (size_t i = begin; i < end; i++)
+        {
+            const TokenType type = m_tokens.type(i);
+            if (type == TokenType::open_curly)
+            {
+                result.change++;
+            }
+            else if (type == TokenType::close_curly)
+            {
+                result.change--;
+                result.lowest = std::min(result.lowest, result.change);
+            }
+        }
+        return result;
+    }
+
+    // First index at or after pos where a top level statement starts: the
+    // token before it is a `;` or `}` at depth 0, and it isn't an elif or
+    // else carrying on the if before it
+    [[nodiscard]] inline size_t next_boundary(size_t pos, int64_t depth) const
+    {
+        const size_t size = m_tokens.size();
+        for (; pos < size; pos++)
+        {
+            const TokenType type = m_tokens.type(pos);
+            if (type == TokenType::open_curly)
+            {
+                depth++;
+                continue;
+            }
+            if (type == TokenType::close_curly)
+            {
+                depth--;
+            }
+            else if (type != TokenType::semi)
+            {
+                continue;
+            }
+            if (depth == 0 && (pos + 1 == size || (m_tokens.type(pos + 1) != TokenType::elif && m_tokens.type(pos + 1) != TokenType::else_)))
+            {
+                return pos + 1;
+            }
+        }
+        return size;
+    }
+
+    // moves the children of node to where the piece's nodes and lists start
+    static inline void rebase(Node &node, const uint32_t first_node, const uint32_t first_list)
+    {
+        switch (node.kind)
+        {
+        case NodeKind::term_ident:
+        case NodeKind::term_int_lit:
+            break;
+        case NodeKind::bin_add:
+        case NodeKind::bin_sub:
+        case NodeKind::bin_multi:
+        case NodeKind::bin_div:
+            node.a += first_node;
+            node.b += first_node;
+            break;
+        case NodeKind::stmt_exit:
+            node.a += first_node;
+            break;
+        case NodeKind::stmt_let:
+        case NodeKind::stmt_const:
+            node.b += first_node;
+            break;
+        case NodeKind::stmt_scope:
+            node.a += first_list;
+            break;
+        case NodeKind::stmt_if:
+        case NodeKind::if_pred_elif:
+            node.a += first_node;
+            node.b += first_node;
+            if (node.c != no_node)
+            {
+                node.c += first_node;
+            }
+            break;
+        case NodeKind::if_pred_else:
+            node.b += first_node;
+            break;
+        }
+    }
+
+    static inline void copy_piece(const Piece &piece, NodeProg &prog)
+    {
+        const auto first_node = static_cast<uint32_t>(piece.first_node);
+        const auto first_list = static_cast<uint32_t>(piece.first_list);
+        for (size_t i = 0; i < piece.prog.nodes.size(); i++)
+        {
+            Node node = piece.prog.nodes[i];
+            rebase(node, first_node, first_list);
+            prog.nodes[piece.first_node + i] = node;
+        }
+        for (size_t i = 0; i < piece.prog.lists.size(); i++)
+        {
+            prog.lists[piece.first_list + i] = piece.prog.lists[i] + first_node;
+        }
+        for (size_t i = 0; i < piece.prog.stmts.size(); i++)
+        {
+            prog.stmts[piece.first_stmt + i] = piece.prog.stmts[i] + first_node;
+        }
+    }
+
+    TokenBuffer m_tokens;
+    const size_t m_threads;
+    const bool m_share_exprs;
+    std::vector<Piece> m_pieces;
+};
@@ -0,0 +1,186 @@
+#pragma once
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include "./parallel.hpp"
+#include "./tokenization.hpp"
+
+// Splits a source buffer into chunks and tokenizes them on separate threads
+// The result is exactly what Tokenizer::tokenize gives for the whole buffer,
+// including the symbol ids
+class ParallelTokenizer
+{
+public:
+    inline ParallelTokenizer(std::string_view src, SymbolTable &symbols, const size_t threads)
+        : m_src(src),
+          m_symbols(symbols),
+          m_threads(threads)
+    {
+    }
+
+    inline TokenBuffer tokenize()
+    {
+        split();
+        if (m_chunks.size() < 2)
+        {
+            return Tokenizer(m_src, m_symbols).tokenize();
+        }
+
+        // 1. for every chunk, where its tokens start and which state it ends in,
+        //    both for starting normally and for starting inside a block comment
+        parallel_for(m_chunks.size(), [this](const size_t i)
+                     { scan_comments(m_chunks[i]); });
+
+        // 2. chain the states, only the first chunk is known to start normally
+        bool in_comment = false;
+        for (Chunk &chunk : m_chunks)
+        {
+            chunk.starts_in_comment = in_comment;
+            in_comment = in_comment ? chunk.ends_in_comment_from_comment : chunk.ends_in_comment;
+        }
+
+        // 3. tokenize every chunk on its own with a private symbol table
+        parallel_for(m_chunks.size(), [this](const size_t i)
+                     { lex(m_chunks[i]); });
+
+        // 4. intern the private symbols in chunk order, which gives them the
+        //    same ids a single pass over the buffer would have
+        size_t total = 0;
+        size_t total_ints = 0;
+        for (Chunk &chunk : m_chunks)
+        {
+            chunk.first_token = total;
+            chunk.first_int = total_ints;
+            total += chunk.tokens.size();
+            total_ints += chunk.tokens.int_count();
+            chunk.remap.resize(chunk.symbols->size());
+            for (Symbol local = 0; local < chunk.symbols->size(); local++)
+            {
+                chunk.remap[local] = m_symbols.intern_view(chunk.symbols->name(local));
+            }
+        }
+
+        // 5. copy everything into place
+        TokenBuffer tokens;
+        tokens.resize(total, total_ints);
+        parallel_for(m_chunks.size(), [this, &tokens](const size_t i)
+                     {
+                         const Chunk &chunk = m_chunks[i];
+                         tokens.copy_from(chunk.tokens, chunk.first_token, chunk.first_int, chunk.remap);
+                     });
+        return tokens;
+    }
+
+private:
+    struct Chunk
+    {
+        size_t begin;
+        size_t end;
+        // where lexing starts when the chunk begins inside a block comment
+        // (just past the "*/", or end if the comment doesn't close in this chunk)
+        size_t resume = 0;
+        bool ends_in_comment = false;
+        bool ends_in_comment_from_comment = false;
+        bool starts_in_comment = false;
+
+        std::unique_ptr<SymbolTable> symbols;
+        TokenBuffer tokens;
+        std::vector<Symbol> remap;
+        size_t first_token = 0;
+        size_t first_int = 0;
+    };
+
+    // Chunks always end right after a newline, no token and no "//", "/*" or "*/"
+    // spans a newline, so the only state that carries over from one chunk to
+    // the next is whether it is inside a block comment
+    inline void split()
+    {
+        // not worth the threads for small inputs
+        constexpr size_t min_chunk = 256 * 1024;
+        const size_t count = std::min(m_threads, m_src.size() / min_chunk);
+        size_t begin = 0;
+        for (size_t i = 1; i < count && begin < m_src.size(); i++)
+        {
+            const size_t target = std::max(begin, m_src.size() / count * i);
+            const size_t newline = m_src.find('\n', target);
+            if (newline == std::string_view::npos)
+            {
+                break;
+            }
+            m_chunks.push_back({.begin = begin, .end = newline + 1});
+            begin = newline + 1;
+        }
+        if (m_chunks.empty())
+        {
+            return;
+        }
+        m_chunks.push_back({.begin = begin, .end = m_src.size()});
+    }
+
+    // Follows only the comment syntax, the same way the Tokenizer does:
+    // every '/' either starts a comment or is a token on its own
+    // returns whether the chunk ends inside a block comment when starting at pos
+    inline bool ends_in_comment(const std::string_view text, size_t pos) const
+    {
+        while (true)
+        {
+            const size_t slash = text.find('/', pos);
+            if (slash == std::string_view::npos || slash + 1 == text.size())
+            {
+                return false;
+            }
+            if (text[slash + 1] == '/')
+            {
+                const size_t newline = text.find('\n', slash + 2);
+                if (newline == std::string_view::npos)
+                {
+                    return false;
+                }
+                pos = newline;
+            }
+            else if (text[slash + 1] == '*')
+            {
+                const size_t close = text.find("*/", slash + 2);
+                if (close == std::string_view::npos)
+                {
+                    return true;
+                }
+                pos = close + 2;
+            }
+            else
+            {
+                pos = slash + 1;
+            }
+        }
+    }
+
+    inline void scan_comments(Chunk &chunk) const
+    {
+        const std::string_view text = m_src.substr(chunk.begin, chunk.end - chunk.begin);
+        chunk.ends_in_comment = ends_in_comment(text, 0);
+        const size_t close = text.find("*/");
+        if (close == std::string_view::npos)
+        {
+            chunk.resume = text.size();
+            chunk.ends_in_comment_from_comment = true;
+        }
+        else
+        {
+            chunk.resume = close + 2;
+            chunk.ends_in_comment_from_comment = ends_in_comment(text, chunk.resume);
+        }
+    }
+
+    inline void lex(Chunk &chunk) const
+    {
+        const size_t begin = chunk.begin + (chunk.starts_in_comment ? chunk.resume : 0);
+        chunk.symbols = std::make_unique<SymbolTable>();
+        chunk.tokens = Tokenizer(m_src.substr(begin, chunk.end - begin), *chunk.symbols).tokenize();
+    }
+
+    const std::string_view m_src;
+    SymbolTable &m_symbols;
+    const size_t m_threads;
+    std::vector<Chunk> m_chunks;
+};
@@ -1,457 +1,701 @@
-#pragma once
-#include <variant>
-#include <vector>
-#include <algorithm>
-#include "./tokenization.hpp"
-#include "./arena.hpp"
-
-struct NodeTermIntLit
-{
-    Token int_lit;
-};
-
-struct NodeTermIdent
-{
-    Token ident;
-};
-struct NodeExpr;
-
-struct NodeTermParen
-{
-    NodeExpr *expr;
-};
-
-struct NodeBinExprAdd
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExprMulti
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExprSub
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExprDiv
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExpr
-{
-    std::variant<NodeBinExprAdd *, NodeBinExprMulti *, NodeBinExprSub *, NodeBinExprDiv *> var{};
-};
-
-struct NodeTerm
-{
-    std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *> var{};
-};
-struct NodeExpr
-{
-    std::variant<NodeTerm *, NodeBinExpr *> var{};
-};
-struct NodeStmtExit
-{
-    NodeExpr *expr;
-};
-
-struct NodeStmtLet
-{
-    Token ident;
-    NodeExpr *expr{};
-};
-
-struct NodeStmt;
-struct NodeIfPred;
-struct NodeScope
-{
-    std::vector<NodeStmt *> stmts;
-};
-
-struct NodeIfPredElif {
-    NodeExpr *expr{};
-    NodeScope *scope{};
-    std::optional<NodeIfPred*> pred{};
-
-};
-
-struct NodeIfPredElse {
-    NodeScope *scope;
-};
-
-struct NodeIfPred {
-    std::variant<NodeIfPredElif*,NodeIfPredElse*> var;
-};
-struct NodeStmtIf
-{
-    NodeExpr *expr;
-    NodeScope *scope;
-    std::optional<NodeIfPred*> pred;
-};
-
-struct NodeStmt
-{
-    std::variant<NodeStmtExit *, NodeStmtLet *, NodeScope *, NodeStmtIf *> var{};
-};
-
-struct NodeProg
-{
-    std::vector<NodeStmt *> stmts;
-};
-
-class Parser
-{
-public:
-    explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens)),
-          m_allocator(1024 * 1024 * 4)
-    {
-    }
-
-    std::optional<NodeTerm *> parse_term()
-    {
-        if (auto int_lit = try_consume(TokenType::int_lit))
-        {
-            auto term_int_lit = m_allocator.alloc<NodeTermIntLit>();
-            term_int_lit->int_lit = int_lit.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_int_lit;
-            return term;
-        }
-
-        if (auto ident = try_consume(TokenType::ident))
-        {
-            auto term_ident = m_allocator.alloc<NodeTermIdent>();
-            term_ident->ident = ident.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_ident;
-            return term;
-        }
-        if (auto open_paren = try_consume(TokenType::open_paran))
-        {
-            auto expr = parse_expr();
-            if (!expr.has_value())
-            {
-                std::cerr << "Expected Expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            try_consume(TokenType::close_paran, "Expected closing parenthesis");
-            auto term_paren = m_allocator.alloc<NodeTermParen>();
-            term_paren->expr = expr.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_paren;
-            return term;
-        }
-
-        return {};
-    }
-
-    // Parsing according to precedence in order
-    // Basically it treats expression in 3 parts
-    // Lhs, Operator, Rhs
-    // BinExpr.png
-    std::optional<NodeExpr *> parse_expr(int min_precedence = 0)
-    {
-        // if we dont have lhs than just
-        // return null
-        std::optional<NodeTerm *> term_lhs = parse_term();
-        if (!term_lhs.has_value())
-        {
-            return {};
-        }
-
-        auto expr_lhs = m_allocator.alloc<NodeExpr>();
-        expr_lhs->var = term_lhs.value();
-
-        while (true)
-        {
-            std::optional<Token> curr_token = peek();
-            std::optional<int> prec;
-            if (curr_token.has_value())
-            {
-                prec = binExpr_prec(curr_token->type);
-                if (!prec.has_value() || prec < min_precedence)
-                {
-                    break;
-                }
-            }
-            else
-            {
-                break;
-            }
-            const Token op = consume();
-            int next_min_prec = prec.value() + 1;
-            auto expr_rhs = parse_expr(next_min_prec);
-            if (!expr_rhs.has_value())
-            {
-                std::cerr << "Unable to parse expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-
-            auto expr = m_allocator.alloc<NodeBinExpr>();
-            const auto expr_lhs2 = m_allocator.alloc<NodeExpr>();
-
-            // expr_lhs->var = term_lhs.value();
-
-            if (op.type == TokenType::plus)
-            {
-                auto add = m_allocator.alloc<NodeBinExprAdd>();
-                expr_lhs2->var = expr_lhs->var;
-                add->lhs = expr_lhs2;
-                add->rhs = expr_rhs.value();
-                expr->var = add;
-            }
-            else if (op.type == TokenType::star)
-            {
-                auto multi = m_allocator.alloc<NodeBinExprMulti>();
-                expr_lhs2->var = expr_lhs->var;
-                multi->lhs = expr_lhs2;
-                multi->rhs = expr_rhs.value();
-                expr->var = multi;
-            }
-            else if (op.type == TokenType::minus)
-            {
-                auto sub = m_allocator.alloc<NodeBinExprSub>();
-                expr_lhs2->var = expr_lhs->var;
-                sub->lhs = expr_lhs2;
-                sub->rhs = expr_rhs.value();
-                expr->var = sub;
-            }
-            else if (op.type == TokenType::fslash)
-            {
-                auto div = m_allocator.alloc<NodeBinExprDiv>();
-                expr_lhs2->var = expr_lhs->var;
-                div->lhs = expr_lhs2;
-                div->rhs = expr_rhs.value();
-                expr->var = div;
-            }
-            else
-            {
-                std::cerr << "Invalid operator" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            expr_lhs->var = expr;
-        }
-        return expr_lhs;
-    }
-    std::optional<NodeScope *> parse_scope()
-    {
-        if (!try_consume(TokenType::open_curly).has_value())
-        {
-            return {};
-        }
-
-        auto scope = m_allocator.alloc<NodeScope>();
-        while (auto stmt = parse_stmt())
-        {
-            scope->stmts.push_back(stmt.value());
-        }
-        try_consume(TokenType::close_curly, "Expected `}`");
-        return scope;
-    }
-
-    std::optional<NodeIfPred*> parse_if_pred()
-    {
-        if (try_consume(TokenType::elif)) {
-            try_consume(TokenType::open_paran, "Expected `(`");
-
-            const auto elif = m_allocator.alloc<NodeIfPredElif>();
-
-            if (const auto expr = parse_expr()) {
-                elif->expr = expr.value();
-            }
-            else {
-                std::cerr << "Expected expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            try_consume(TokenType::close_paran, "Expected `)`");
-            if (const auto scope = parse_scope()) {
-                elif->scope = scope.value();
-            }
-            else {
-                std::cerr << "Expected scope" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            elif->pred = parse_if_pred();
-            auto pred = m_allocator.emplace<NodeIfPred>(elif);
-            return pred;
-        }
-        if (try_consume(TokenType::else_)) {
-            auto else_ = m_allocator.alloc<NodeIfPredElse>();
-            if (const auto scope = parse_scope()) {
-                else_->scope = scope.value();
-            }
-            else {
-                std::cerr << "Expected scope" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            auto pred = m_allocator.emplace<NodeIfPred>(else_);
-            return pred;
-        }
-        return {};
-    }
-
-
-    std::optional<NodeStmt *>
-    parse_stmt()
-    {
-        if (peek().value().type == TokenType::exit && peek(1).has_value() && peek(1).value().type == TokenType::open_paran)
-        {
-            consume();
-            consume();
-            auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
-            if (auto node_expr = parse_expr())
-            {
-                // error type checking
-                stmt_exit->expr = node_expr.value();
-            }
-            else
-            {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            try_consume(TokenType::close_paran, "Expected `)`");
-            try_consume(TokenType::semi, "Expected ';'");
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_exit;
-            return stmt;
-        }
-        else if (peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value() && peek(1).value().type == TokenType::ident && peek(2).has_value() && peek(2).value().type == TokenType::eq)
-        {
-            consume();
-            auto stmt_let = m_allocator.alloc<NodeStmtLet>();
-            stmt_let->ident = consume();
-            consume();
-            if (auto expr = parse_expr())
-            {
-                stmt_let->expr = expr.value();
-            }
-            else
-            {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            try_consume(TokenType::semi, "Expected ';'");
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_let;
-            return stmt;
-        }
-        else if (peek().has_value() && peek().value().type == TokenType::open_curly)
-        {
-            if (auto scope = parse_scope())
-            {
-                auto stmt = m_allocator.alloc<NodeStmt>();
-                stmt->var = scope.value();
-                return stmt;
-            }
-            else
-            {
-                std::cerr << "Invalid Scope" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-        }
-        else if (auto if_ = try_consume(TokenType::if_))
-        {
-            try_consume(TokenType::open_paran, "Expected `(`");
-            auto stmt_if = m_allocator.alloc<NodeStmtIf>();
-            if (auto expr = parse_expr())
-            {
-                stmt_if->expr = expr.value();
-            }
-            else
-            {
-                std::cerr << "Invalid Expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            try_consume(TokenType::close_paran, "Expected `)`");
-            if (auto scope = parse_scope())
-            {
-                stmt_if->scope = scope.value();
-            }
-            else
-            {
-                std::cerr << "Invalid Scope" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            stmt_if->pred =  parse_if_pred();
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_if;
-            return stmt;
-        }
-        else
-        {
-            return {};
-        }
-    }
-
-     std::optional<NodeProg> parseProg()
-    {
-        NodeProg prog;
-        while (peek().has_value())
-        {
-            if (auto stmt = parse_stmt())
-            {
-                prog.stmts.push_back(stmt.value());
-            }
-            else
-            {
-                std::cerr << "Invalid statement" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-        }
-        return prog;
-    }
-
-private:
-    [[nodiscard]] std::optional<Token> peek(const int offset = 0) const
-    {
-        if (m_index + offset >= m_tokens.size())
-        {
-            return {};
-        }
-        else
-        {
-            return m_tokens.at(m_index + offset);
-        }
-    }
-    Token consume()
-    {
-        return m_tokens.at(m_index++);
-    }
-
-    std::optional<Token> try_consume(TokenType type)
-    {
-        if (peek().has_value() && peek().value().type == type)
-        {
-            return consume();
-        }
-        else
-        {
-            return {};
-        }
-    }
-
-    Token try_consume(TokenType type, const std::string &err_msg)
-    {
-        if (peek().has_value() && peek().value().type == type)
-        {
-            return consume();
-        }
-        else
-        {
-            std::cerr << err_msg << std::endl;
-            exit(EXIT_FAILURE);
-        }
-    }
-    const std::vector<Token> m_tokens;
-    size_t m_index = 0;
-    ArenaAllocator m_allocator;
+#pragma once
+#include <span>
+#include <vector>
+#include <algorithm>
+#include "./errors.hpp"
+#include "./tokenization.hpp"
+
+// The AST is one flat array of Nodes, children are referred to by their
+// index in that array instead of by pointer
+using NodeIndex = uint32_t;
+inline constexpr NodeIndex no_node = UINT32_MAX;
+
+enum class NodeKind : uint8_t
+{
+    // a = symbol
+    term_ident,
+    // value split over b (low half) and c (high half), width is set
+    term_int_lit,
+    // a = lhs, b = rhs
+    bin_add,
+    bin_sub,
+    bin_multi,
+    bin_div,
+    // a = expr
+    stmt_exit,
+    // a = symbol, b = expr, c = declared IntType (none to infer it)
+    stmt_let,
+    // same as stmt_let, the value is computed at compile time
+    stmt_const,
+    // a = first statement in NodeProg::lists, b = number of statements
+    stmt_scope,
+    // a = expr, b = scope, c = pred (or no_node)
+    stmt_if,
+    // a = expr, b = scope, c = pred (or no_node)
+    if_pred_elif,
+    // b = scope
+    if_pred_else,
+};
+
+// 16 bytes, four of them share a cache line
+struct Node
+{
+    NodeKind kind;
+    ImmWidth width{};
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+};
+
+inline bool is_bin_expr(const NodeKind kind)
+{
+    return kind >= NodeKind::bin_add && kind <= NodeKind::bin_div;
+}
+
+struct NodeProg
+{
+    std::vector<Node> nodes;
+    // statement lists of all scopes, each scope owns a contiguous range
+    std::vector<NodeIndex> lists;
+    // top level statements in program order
+    std::vector<NodeIndex> stmts;
+
+    NodeIndex add(const Node node)
+    {
+        nodes.push_back(node);
+        return static_cast<NodeIndex>(nodes.size() - 1);
+    }
+
+    static Node int_lit(const int64_t value)
+    {
+        const auto bits = static_cast<uint64_t>(value);
+        return {.kind = NodeKind::term_int_lit,
+                .width = imm_width(value),
+                .b = static_cast<uint32_t>(bits),
+                .c = static_cast<uint32_t>(bits >> 32)};
+    }
+
+    NodeIndex add_int_lit(const int64_t value)
+    {
+        return add(int_lit(value));
+    }
+
+    [[nodiscard]] const Node &operator[](const NodeIndex index) const
+    {
+        return nodes[index];
+    }
+
+    [[nodiscard]] int64_t int_value(const Node &node) const
+    {
+        return static_cast<int64_t>(static_cast<uint64_t>(node.b) | (static_cast<uint64_t>(node.c) << 32));
+    }
+
+    [[nodiscard]] std::span<const NodeIndex> scope_stmts(const Node &scope) const
+    {
+        return {lists.data() + scope.a, scope.b};
+    }
+};
+
+// Where a statement or scope is in the source: begin is the first byte
+// of its first token, end is just past its last token
+struct Span
+{
+    uint32_t begin = 0;
+    uint32_t end = 0;
+};
+
+// Hash consing for expression nodes: finds the node in a prog that is
+// structurally identical to a new one so the two can share it
+// Nodes are added bottom up, so by the time a node is looked up its
+// children are shared already and comparing child indices is enough
+// Sharing a node means the same expression, not the same value, a name can
+// be declared again once the scope of the first declaration has ended
+class ExprInterner
+{
+public:
+    // index of the node equal to node, which is added to prog if there is none
+    NodeIndex intern(NodeProg &prog, const Node &node)
+    {
+        if (m_slots.empty())
+        {
+            m_slots.assign(1024, 0);
+        }
+        size_t mask = m_slots.size() - 1;
+        size_t slot = hash(node) & mask;
+        // open addressing with linear probing, slots hold node index + 1 (0 is empty)
+        while (m_slots[slot] != 0)
+        {
+            const Node &existing = prog[m_slots[slot] - 1];
+            if (existing.kind == node.kind && existing.width == node.width &&
+                existing.a == node.a && existing.b == node.b && existing.c == node.c)
+            {
+                return m_slots[slot] - 1;
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        const NodeIndex index = prog.add(node);
+        m_slots[slot] = index + 1;
+        // keep the table at most half full
+        if (++m_count * 2 > m_slots.size())
+        {
+            std::vector<uint32_t> slots(m_slots.size() * 2, 0);
+            mask = slots.size() - 1;
+            for (const uint32_t entry : m_slots)
+            {
+                if (entry == 0)
+                {
+                    continue;
+                }
+                size_t to = hash(prog[entry - 1]) & mask;
+                while (slots[to] != 0)
+                {
+                    to = (to + 1) & mask;
+                }
+                slots[to] = entry;
+            }
+            m_slots = std::move(slots);
+        }
+        return index;
+    }
+
+private:
+    static uint64_t hash(const Node &node)
+    {
+        uint64_t h = static_cast<uint64_t>(node.kind) | static_cast<uint64_t>(node.width) << 8 | static_cast<uint64_t>(node.a) << 32;
+        h = (h ^ (static_cast<uint64_t>(node.b) | static_cast<uint64_t>(node.c) << 32)) * 0x9E3779B97F4A7C15u;
+        return h ^ (h >> 29);
+    }
+
+    std::vector<uint32_t> m_slots;
+    size_t m_count = 0;
+};
+
+class Parser
+{
+public:
+    explicit Parser(TokenBuffer tokens)
+        : m_tokens(std::move(tokens))
+    {
+        // every node comes from a token of its own, so this is enough for
+        // any program (typical ones need about half of it)
+        m_prog.nodes.reserve(m_tokens.size_hint());
+    }
+
+    // Pulls tokens from the tokenizer as parsing goes instead of
+    // needing all of them up front, only the lookahead is buffered
+    explicit Parser(Tokenizer &tokenizer)
+        : m_tokens(tokenizer)
+    {
+    }
+
+    // Takes tokens from a tokenizer running on another thread
+    explicit Parser(SpscRing<TokenBuffer> &tokens)
+        : m_tokens(tokens)
+    {
+    }
+
+    // Parses the tokens [begin, end) of a buffer that is shared with
+    // other parsers, see ParallelParser
+    Parser(const TokenBuffer &tokens, const size_t begin, const size_t end)
+        : m_tokens(tokens, begin, end)
+    {
+        m_prog.nodes.reserve(m_tokens.size_hint());
+    }
+
+    // Appends the new nodes to an existing prog, used to reparse part of it
+    Parser(TokenBuffer tokens, NodeProg prog)
+        : m_tokens(std::move(tokens)),
+          m_prog(std::move(prog))
+    {
+    }
+
+    // Makes structurally identical expressions share one node, so the
+    // expressions of the prog form a DAG instead of a tree
+    void share_exprs()
+    {
+        m_share_exprs = true;
+    }
+
+    // Records the Span of every statement and scope node in spans (indexed
+    // by NodeIndex), base is added to all of them
+    // The tokens have to come from Tokenizer::tokenize_with_offsets
+    void record_spans(std::vector<Span> &spans, const uint32_t base = 0)
+    {
+        m_spans = &spans;
+        m_span_base = base;
+    }
+
+    std::optional<NodeIndex> parse_term()
+    {
+        if (auto int_lit = try_consume(TokenType::int_lit))
+        {
+            return add_expr(NodeProg::int_lit(m_tokens.int_value(int_lit.value())));
+        }
+
+        if (auto ident = try_consume(TokenType::ident))
+        {
+            return add_expr({.kind = NodeKind::term_ident, .a = m_tokens.symbol(ident.value())});
+        }
+
+        return {};
+    }
+
+    // Parsing according to precedence in order
+    // Basically it treats expression in 3 parts
+    // Lhs, Operator, Rhs
+    // BinExpr.png
+    // Operands and pending operators live on explicit stacks instead of the
+    // call stack, an operator is reduced once one of lower or equal
+    // precedence follows it, which builds the same left associative tree
+    // as precedence climbing. An open parenthesis sits on the operator
+    // stack as a marker and stops reductions until its `)` is reached
+    std::optional<NodeIndex> parse_expr()
+    {
+        const size_t operands_base = m_operands.size();
+        const size_t operators_base = m_operators.size();
+        size_t open_parens = 0;
+        while (true)
+        {
+            // parentheses only group, they don't need a node of their own
+            if (try_consume(TokenType::open_paran))
+            {
+                m_operators.push_back(TokenType::open_paran);
+                open_parens++;
+                continue;
+            }
+            const std::optional<NodeIndex> term = parse_term();
+            if (!term.has_value())
+            {
+                if (m_operators.size() == operators_base)
+                {
+                    return {};
+                }
+                if (m_operators.back() == TokenType::open_paran)
+                {
+                    fail("Expected Expression");
+                }
+                fail("Unable to parse expression");
+            }
+            m_operands.push_back(term.value());
+
+            while (open_parens > 0 && try_consume(TokenType::close_paran))
+            {
+                while (m_operators.back() != TokenType::open_paran)
+                {
+                    reduce();
+                }
+                m_operators.pop_back();
+                open_parens--;
+            }
+
+            const std::optional<TokenType> curr_token = m_tokens.peek();
+            const std::optional<int> prec = curr_token.has_value() ? binExpr_prec(curr_token.value()) : std::nullopt;
+            if (!prec.has_value())
+            {
+                break;
+            }
+            while (m_operators.size() > operators_base && binExpr_prec(m_operators.back()) >= prec)
+            {
+                reduce();
+            }
+            m_operators.push_back(m_tokens.type(m_tokens.consume()));
+        }
+
+        if (open_parens > 0)
+        {
+            fail("Expected closing parenthesis");
+        }
+        while (m_operators.size() > operators_base)
+        {
+            reduce();
+        }
+        const NodeIndex expr = m_operands.back();
+        m_operands.resize(operands_base);
+        return expr;
+    }
+
+    // Scopes and if chains are parsed with an explicit stack of the
+    // constructs that are still open. `{`, `if`, `elif` and `else` push a
+    // frame, and every finished statement or scope is handed to the frame
+    // below it, so nesting depth costs heap memory instead of native stack
+    std::optional<NodeIndex>
+    parse_stmt()
+    {
+        std::optional<NodeIndex> done;
+        while (true)
+        {
+            if (!done.has_value())
+            {
+                if (m_tokens.peek_is(TokenType::exit) && m_tokens.peek_is(TokenType::open_paran, 1))
+                {
+                    done = parse_exit();
+                }
+                else if ((m_tokens.peek_is(TokenType::let) || m_tokens.peek_is(TokenType::const_)) && m_tokens.peek_is(TokenType::ident, 1) &&
+                         (m_tokens.peek_is(TokenType::eq, 2) || m_tokens.peek_is(TokenType::colon, 2)))
+                {
+                    done = parse_let();
+                }
+                else if (auto open = try_consume(TokenType::open_curly))
+                {
+                    open_scope(open.value());
+                    continue;
+                }
+                else if (auto if_ = try_consume(TokenType::if_))
+                {
+                    open_if(if_.value());
+                    continue;
+                }
+                else if (!m_frames.empty() && !m_frames.back().is_if)
+                {
+                    // no more statements in this scope
+                    done = close_scope();
+                }
+                else
+                {
+                    return {};
+                }
+            }
+
+            if (m_frames.empty())
+            {
+                return done;
+            }
+            Frame &frame = m_frames.back();
+            if (!frame.is_if)
+            {
+                m_stmt_stack.push_back(done.value());
+                done.reset();
+                continue;
+            }
+
+            // the scope of the `if` itself or of its latest pred
+            if (m_preds.size() == frame.first)
+            {
+                frame.node.b = done.value();
+            }
+            else
+            {
+                m_preds.back().b = done.value();
+            }
+            done.reset();
+            if (m_preds.size() == frame.first || m_preds.back().kind != NodeKind::if_pred_else)
+            {
+                if (try_consume(TokenType::elif))
+                {
+                    open_elif();
+                    continue;
+                }
+                if (try_consume(TokenType::else_))
+                {
+                    open_else();
+                    continue;
+                }
+            }
+            done = close_if();
+        }
+    }
+
+    // parses statements until the tokens run out
+    void parse_stmts(std::vector<NodeIndex> &stmts)
+    {
+        while (m_tokens.peek().has_value())
+        {
+            stmts.push_back(expect_stmt());
+        }
+    }
+
+    // Parses the next few top level statements into a prog of their own,
+    // empty at the end of the input
+    // The parts can go to a Generator running at the same time, see
+    // Generator::gen_stmts
+    std::optional<NodeProg> parse_part(const size_t min_nodes = 4096)
+    {
+        while (m_prog.nodes.size() < min_nodes && m_tokens.peek().has_value())
+        {
+            m_prog.stmts.push_back(expect_stmt());
+        }
+        if (m_prog.stmts.empty())
+        {
+            return {};
+        }
+        // node indices start over in the next part
+        m_exprs = {};
+        return std::exchange(m_prog, {});
+    }
+
+     std::optional<NodeProg> parseProg()
+    {
+        parse_stmts(m_prog.stmts);
+        return std::move(m_prog);
+    }
+
+    // hands back the prog after parse_stmts
+    NodeProg take_prog()
+    {
+        return std::move(m_prog);
+    }
+
+private:
+    NodeIndex expect_stmt()
+    {
+        if (auto stmt = parse_stmt())
+        {
+            return stmt.value();
+        }
+        fail("Invalid statement");
+    }
+
+    std::optional<NodeIndex> parse_exit()
+    {
+        const TokenRef first = m_tokens.consume();
+        m_tokens.consume();
+        Node stmt_exit{.kind = NodeKind::stmt_exit};
+        if (auto node_expr = parse_expr())
+        {
+            // error type checking
+            stmt_exit.a = node_expr.value();
+        }
+        else
+        {
+            fail("Invalid expression");
+        }
+        try_consume(TokenType::close_paran, "Expected `)`");
+        const TokenRef last = try_consume(TokenType::semi, "Expected ';'");
+        return add_stmt(stmt_exit, first, last);
+    }
+
+    // `let` and `const` declarations
+    std::optional<NodeIndex> parse_let()
+    {
+        const TokenRef first = m_tokens.consume();
+        Node stmt_let{.kind = m_tokens.type(first) == TokenType::const_ ? NodeKind::stmt_const : NodeKind::stmt_let};
+        stmt_let.a = m_tokens.symbol(m_tokens.consume());
+        if (try_consume(TokenType::colon))
+        {
+            // the value of a type name token is its IntType
+            stmt_let.c = m_tokens.symbol(try_consume(TokenType::type_name, "Expected type"));
+        }
+        try_consume(TokenType::eq, "Expected `=`");
+        if (auto expr = parse_expr())
+        {
+            stmt_let.b = expr.value();
+        }
+        else
+        {
+            fail("Invalid expression");
+        }
+        const TokenRef last = try_consume(TokenType::semi, "Expected ';'");
+        return add_stmt(stmt_let, first, last);
+    }
+
+    // called after the `{`
+    void open_scope(const TokenRef open)
+    {
+        m_frames.push_back({.is_if = false, .first = m_stmt_stack.size(), .open = open});
+    }
+
+    NodeIndex close_scope()
+    {
+        m_last_close = try_consume(TokenType::close_curly, "Expected `}`");
+
+        const size_t first = m_frames.back().first;
+        const TokenRef open = m_frames.back().open;
+        m_frames.pop_back();
+        const auto list = static_cast<uint32_t>(m_prog.lists.size());
+        const auto count = static_cast<uint32_t>(m_stmt_stack.size() - first);
+        m_prog.lists.insert(m_prog.lists.end(), m_stmt_stack.begin() + first, m_stmt_stack.end());
+        m_stmt_stack.resize(first);
+        return add_stmt({.kind = NodeKind::stmt_scope, .a = list, .b = count}, open, m_last_close);
+    }
+
+    // called after the `if`, leaves the frames of the if and its scope open
+    void open_if(const TokenRef if_)
+    {
+        try_consume(TokenType::open_paran, "Expected `(`");
+        Node stmt_if{.kind = NodeKind::stmt_if};
+        if (auto expr = parse_expr())
+        {
+            stmt_if.a = expr.value();
+        }
+        else
+        {
+            fail("Invalid Expression");
+        }
+        try_consume(TokenType::close_paran, "Expected `)`");
+        const auto open = try_consume(TokenType::open_curly);
+        if (!open.has_value())
+        {
+            fail("Invalid Scope");
+        }
+        m_frames.push_back({.is_if = true, .node = stmt_if, .first = m_preds.size(), .open = if_});
+        open_scope(open.value());
+    }
+
+    // called after the `elif`, the pred is kept in m_preds until the whole
+    // chain is parsed
+    void open_elif()
+    {
+        try_consume(TokenType::open_paran, "Expected `(`");
+
+        Node elif{.kind = NodeKind::if_pred_elif};
+
+        if (const auto expr = parse_expr()) {
+            elif.a = expr.value();
+        }
+        else {
+            fail("Expected expression");
+        }
+        try_consume(TokenType::close_paran, "Expected `)`");
+        const auto open = try_consume(TokenType::open_curly);
+        if (!open.has_value()) {
+            fail("Expected scope");
+        }
+        m_preds.push_back(elif);
+        open_scope(open.value());
+    }
+
+    // called after the `else`
+    void open_else()
+    {
+        const auto open = try_consume(TokenType::open_curly);
+        if (!open.has_value()) {
+            fail("Expected scope");
+        }
+        m_preds.push_back({.kind = NodeKind::if_pred_else});
+        open_scope(open.value());
+    }
+
+    // links the chain back to front, each elif points at the pred after it
+    NodeIndex close_if()
+    {
+        Node stmt_if = m_frames.back().node;
+        const size_t first = m_frames.back().first;
+        const TokenRef if_ = m_frames.back().open;
+        m_frames.pop_back();
+
+        NodeIndex next = no_node;
+        for (size_t i = m_preds.size(); i-- > first;)
+        {
+            Node pred = m_preds[i];
+            if (pred.kind == NodeKind::if_pred_elif)
+            {
+                pred.c = next;
+            }
+            next = m_prog.add(pred);
+        }
+        m_preds.resize(first);
+        stmt_if.c = next;
+        // the chain ends with the `}` of its last scope
+        return add_stmt(stmt_if, if_, m_last_close);
+    }
+
+    NodeIndex add_expr(const Node &node)
+    {
+        return m_share_exprs ? m_exprs.intern(m_prog, node) : m_prog.add(node);
+    }
+
+    NodeIndex add_stmt(const Node node, const TokenRef first, const TokenRef last)
+    {
+        const NodeIndex index = m_prog.add(node);
+        if (m_spans != nullptr)
+        {
+            if (m_spans->size() < m_prog.nodes.size())
+            {
+                m_spans->resize(m_prog.nodes.size());
+            }
+            (*m_spans)[index] = {m_span_base + m_tokens.offset(first), m_span_base + m_tokens.offset(last) + 1};
+        }
+        return index;
+    }
+
+    // pops an operator and its two operands and pushes the combined node
+    void reduce()
+    {
+        const TokenType op = m_operators.back();
+        m_operators.pop_back();
+        const NodeIndex expr_rhs = m_operands.back();
+        m_operands.pop_back();
+        const NodeIndex expr_lhs = m_operands.back();
+
+        NodeKind kind;
+        if (op == TokenType::plus)
+        {
+            kind = NodeKind::bin_add;
+        }
+        else if (op == TokenType::star)
+        {
+            kind = NodeKind::bin_multi;
+        }
+        else if (op == TokenType::minus)
+        {
+            kind = NodeKind::bin_sub;
+        }
+        else if (op == TokenType::fslash)
+        {
+            kind = NodeKind::bin_div;
+        }
+        else
+        {
+            fail("Invalid operator");
+        }
+        m_operands.back() = add_expr({.kind = kind, .a = expr_lhs, .b = expr_rhs});
+    }
+
+    std::optional<TokenRef> try_consume(TokenType type)
+    {
+        if (m_tokens.peek_is(type))
+        {
+            return m_tokens.consume();
+        }
+        else
+        {
+            return {};
+        }
+    }
+
+    TokenRef try_consume(TokenType type, const std::string &err_msg)
+    {
+        if (m_tokens.peek_is(type))
+        {
+            return m_tokens.consume();
+        }
+        else
+        {
+            fail(err_msg);
+        }
+    }
+
+    TokenCursor m_tokens;
+    NodeProg m_prog;
+    // statements of the scopes currently being parsed, a scope's list
+    // is moved into NodeProg::lists once its closing brace is reached
+    std::vector<NodeIndex> m_stmt_stack;
+
+    // a scope or an if chain that is still being parsed
+    struct Frame
+    {
+        bool is_if;
+        // the stmt_if, its expr and scope are filled in as they are parsed
+        Node node{};
+        // where this frame's entries start in m_stmt_stack (scope)
+        // or in m_preds (if)
+        size_t first = 0;
+        // the `{` or `if` token
+        TokenRef open = 0;
+    };
+    std::vector<Frame> m_frames;
+    // elif / else preds of the open if chains
+    std::vector<Node> m_preds;
+    // scratch stacks of parse_expr
+    std::vector<NodeIndex> m_operands;
+    std::vector<TokenType> m_operators;
+    // `}` of the scope closed last
+    TokenRef m_last_close = 0;
+
+    bool m_share_exprs = false;
+    ExprInterner m_exprs;
+
+    std::vector<Span> *m_spans = nullptr;
+    uint32_t m_span_base = 0;
 };
\ No newline at end of file
@@ -0,0 +1,596 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "./ir.hpp"
+
+// A transform of the IR, run returns whether it changed anything
+struct IrPass
+{
+    std::string_view name;
+    bool (*run)(IrProg &, IrAnalyses &);
+    // leaves the blocks and edges alone, so IrAnalyses stay valid
+    bool preserves_cfg;
+};
+
+// the NodeKind an arithmetic op is lowered from, see IrLowering::ir_op
+inline NodeKind bin_kind(const IrOp op)
+{
+    switch (op)
+    {
+    case IrOp::add:
+        return NodeKind::bin_add;
+    case IrOp::sub:
+        return NodeKind::bin_sub;
+    case IrOp::mul:
+        return NodeKind::bin_multi;
+    default:
+        return NodeKind::bin_div;
+    }
+}
+
+// The value of arithmetic on constants, empty if it has to be left for
+// run time because it faults or traps there: a division that faults (see
+// fold_bin_expr) or checked arithmetic that overflows
+inline std::optional<uint64_t> fold_arithmetic(const Inst &inst, const uint64_t lhs, const uint64_t rhs)
+{
+    const NodeKind kind = bin_kind(inst.op);
+    const IntType type = inst.type;
+    if ((inst.checks & check_overflow) != 0 &&
+        op_range(kind, Interval::point_of(lhs, type), Interval::point_of(rhs, type), type, true).may_overflow)
+    {
+        return {};
+    }
+    return fold_bin_expr(kind, lhs, rhs, type);
+}
+
+// Constant folding: arithmetic on constants becomes a constant with the
+// value the generated code would compute (see fold_arithmetic)
+// Blocks are visited in reverse post order, so whole trees of constants
+// fold in one go. Branches on folded values are left to simplify-cfg
+inline bool fold_constants(IrProg &ir, IrAnalyses &analyses)
+{
+    std::vector<uint8_t> is_const(ir.vreg_count, 0);
+    std::vector<uint64_t> values(ir.vreg_count, 0);
+    bool changed = false;
+    for (const BlockId block : analyses.reverse_post_order())
+    {
+        for (Inst &inst : ir.blocks[block].insts)
+        {
+            std::optional<uint64_t> folded;
+            if (inst.op == IrOp::const_)
+            {
+                is_const[inst.dst] = 1;
+                values[inst.dst] = IrProg::const_value(inst);
+            }
+            else if (is_arithmetic(inst.op) && is_const[inst.a] && is_const[inst.b])
+            {
+                folded = fold_arithmetic(inst, values[inst.a], values[inst.b]);
+            }
+            if (folded.has_value())
+            {
+                inst = IrProg::constant(inst.dst, inst.type, folded.value());
+                is_const[inst.dst] = 1;
+                values[inst.dst] = folded.value();
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+// Tidies up the CFG until there is nothing left to tidy:
+// branches that go the same way either way or test a constant become
+// jumps, jumps to blocks that only jump on go straight to the end of the
+// chain, a block that is only ever entered from the one before it is
+// appended to that one, and blocks that can't be reached are dropped
+inline bool simplify_cfg(IrProg &ir, IrAnalyses &)
+{
+    bool changed = false;
+    for (bool again = true; again;)
+    {
+        again = false;
+        std::vector<uint8_t> is_const(ir.vreg_count, 0);
+        std::vector<uint64_t> values(ir.vreg_count, 0);
+        for (const Block &block : ir.blocks)
+        {
+            for (const Inst &inst : block.insts)
+            {
+                if (inst.op == IrOp::const_)
+                {
+                    is_const[inst.dst] = 1;
+                    values[inst.dst] = IrProg::const_value(inst);
+                }
+            }
+        }
+
+        // the block control really ends up in when going to block (a
+        // chain of jumps that goes round in circles is left alone)
+        const auto forward = [&](const BlockId block)
+        {
+            BlockId end = block;
+            for (size_t steps = 0; steps <= ir.blocks.size(); steps++)
+            {
+                const std::vector<Inst> &insts = ir.blocks[end].insts;
+                if (end == 0 || insts.size() != 1 || insts.back().op != IrOp::jump)
+                {
+                    return end;
+                }
+                end = insts.back().a;
+            }
+            return block;
+        };
+        for (BlockId block = 0; block < ir.blocks.size(); block++)
+        {
+            if (ir.blocks[block].insts.empty())
+            {
+                continue;
+            }
+            Inst &last = ir.blocks[block].insts.back();
+            if (last.op == IrOp::branch && (last.b == last.c || is_const[last.a]))
+            {
+                const BlockId taken = last.b == last.c || values[last.a] != 0 ? last.b : last.c;
+                last = {.op = IrOp::jump, .a = taken};
+                again = true;
+            }
+            if (last.op == IrOp::jump)
+            {
+                const BlockId target = forward(last.a);
+                again |= target != last.a;
+                last.a = target;
+            }
+            else if (last.op == IrOp::branch)
+            {
+                for (uint32_t *target : {&last.b, &last.c})
+                {
+                    const BlockId next = forward(*target);
+                    again |= next != *target;
+                    *target = next;
+                }
+            }
+        }
+
+        std::vector<uint32_t> pred_count(ir.blocks.size(), 0);
+        for (BlockId block = 0; block < ir.blocks.size(); block++)
+        {
+            for (const BlockId succ : ir.successors(block))
+            {
+                pred_count[succ]++;
+            }
+        }
+        for (BlockId block = 0; block < ir.blocks.size(); block++)
+        {
+            std::vector<Inst> &insts = ir.blocks[block].insts;
+            while (!insts.empty() && insts.back().op == IrOp::jump)
+            {
+                const BlockId next = insts.back().a;
+                if (next == 0 || next == block || pred_count[next] != 1)
+                {
+                    break;
+                }
+                std::vector<Inst> &moved = ir.blocks[next].insts;
+                insts.pop_back();
+                insts.insert(insts.end(), moved.begin(), moved.end());
+                moved.clear();
+                again = true;
+            }
+        }
+
+        // the blocks that can still be reached keep their order
+        std::vector<uint8_t> reached(ir.blocks.size(), 0);
+        std::vector<BlockId> stack{0};
+        reached[0] = 1;
+        while (!stack.empty())
+        {
+            const BlockId block = stack.back();
+            stack.pop_back();
+            for (const BlockId succ : ir.successors(block))
+            {
+                if (!reached[succ])
+                {
+                    reached[succ] = 1;
+                    stack.push_back(succ);
+                }
+            }
+        }
+        if (std::find(reached.begin(), reached.end(), 0) != reached.end())
+        {
+            std::vector<BlockId> renamed(ir.blocks.size(), no_block);
+            std::vector<Block> blocks;
+            for (BlockId block = 0; block < ir.blocks.size(); block++)
+            {
+                if (reached[block])
+                {
+                    renamed[block] = static_cast<BlockId>(blocks.size());
+                    blocks.push_back(std::move(ir.blocks[block]));
+                }
+            }
+            ir.blocks = std::move(blocks);
+            for (BlockId block = 0; block < ir.blocks.size(); block++)
+            {
+                for (Inst &inst : ir.blocks[block].insts)
+                {
+                    if (inst.op == IrOp::jump)
+                    {
+                        inst.a = renamed[inst.a];
+                    }
+                    else if (inst.op == IrOp::branch)
+                    {
+                        inst.b = renamed[inst.b];
+                        inst.c = renamed[inst.c];
+                    }
+                }
+            }
+            again = true;
+        }
+        changed |= again;
+    }
+    return changed;
+}
+
+// Whether removing inst, if its value is never used, could change what
+// the program does. Checked arithmetic can trap, and a division faults on
+// zero (and, for signed types, on the minimum divided by -1) unless the
+// divisor is a constant that rules that out
+inline bool has_effects(const Inst &inst, const std::vector<const Inst *> &defs)
+{
+    if (is_terminator(inst.op) || inst.checks != 0)
+    {
+        return true;
+    }
+    if (inst.op != IrOp::div)
+    {
+        return false;
+    }
+    const Inst *divisor = defs[inst.b];
+    if (divisor == nullptr || divisor->op != IrOp::const_)
+    {
+        return true;
+    }
+    const uint64_t value = IrProg::const_value(*divisor);
+    return value == 0 || (is_signed(inst.type) && value == UINT64_MAX);
+}
+
+// calls use on every vreg inst reads
+template <typename Use>
+inline void for_each_operand(const Inst &inst, Use &&use)
+{
+    switch (inst.op)
+    {
+    case IrOp::const_:
+    case IrOp::jump:
+        break;
+    case IrOp::branch:
+    case IrOp::exit:
+        use(inst.a);
+        break;
+    default:
+        use(inst.a);
+        use(inst.b);
+        break;
+    }
+}
+
+// Dead code elimination: drops the instructions whose values are never
+// used, and then the ones only those used, as long as dropping them
+// doesn't change what the program does (see has_effects)
+inline bool eliminate_dead_code(IrProg &ir, IrAnalyses &)
+{
+    std::vector<uint32_t> uses(ir.vreg_count, 0);
+    std::vector<const Inst *> defs(ir.vreg_count, nullptr);
+    for (const Block &block : ir.blocks)
+    {
+        for (const Inst &inst : block.insts)
+        {
+            if (inst.dst != no_vreg)
+            {
+                defs[inst.dst] = &inst;
+            }
+            for_each_operand(inst, [&](const VReg vreg)
+                             { uses[vreg]++; });
+        }
+    }
+    std::vector<uint8_t> dead(ir.vreg_count, 0);
+    std::vector<VReg> work;
+    for (VReg vreg = 0; vreg < ir.vreg_count; vreg++)
+    {
+        if (defs[vreg] != nullptr && uses[vreg] == 0 && !has_effects(*defs[vreg], defs))
+        {
+            work.push_back(vreg);
+        }
+    }
+    if (work.empty())
+    {
+        return false;
+    }
+    while (!work.empty())
+    {
+        const VReg vreg = work.back();
+        work.pop_back();
+        dead[vreg] = 1;
+        for_each_operand(*defs[vreg], [&](const VReg operand)
+                         {
+                             if (--uses[operand] == 0 && defs[operand] != nullptr && !has_effects(*defs[operand], defs))
+                             {
+                                 work.push_back(operand);
+                             } });
+    }
+    for (Block &block : ir.blocks)
+    {
+        std::erase_if(block.insts, [&](const Inst &inst)
+                      { return inst.dst != no_vreg && dead[inst.dst]; });
+    }
+    return true;
+}
+
+// Common subexpression elimination: an instruction that computes what an
+// instruction in a dominating block (or earlier in its own) already did
+// is dropped, and its value replaced by that one. Checked arithmetic is
+// included, the first one traps before the second one is reached
+inline bool eliminate_common_subexprs(IrProg &ir, IrAnalyses &analyses)
+{
+    struct Key
+    {
+        IrOp op;
+        IntType type;
+        uint8_t checks;
+        uint32_t a;
+        uint32_t b;
+        uint32_t c;
+
+        bool operator==(const Key &) const = default;
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            uint64_t h = static_cast<uint64_t>(key.op) | static_cast<uint64_t>(key.type) << 8 | static_cast<uint64_t>(key.checks) << 16;
+            for (const uint32_t field : {key.a, key.b, key.c})
+            {
+                h = (h ^ field) * 0x9E3779B97F4A7C15u;
+            }
+            return h ^ (h >> 29);
+        }
+    };
+
+    const DominatorTree &tree = analyses.dominators();
+    // by VReg, what to use instead (itself if nothing)
+    std::vector<VReg> replaced(ir.vreg_count);
+    for (VReg vreg = 0; vreg < ir.vreg_count; vreg++)
+    {
+        replaced[vreg] = vreg;
+    }
+    std::unordered_map<Key, VReg, KeyHash> available;
+    // keys added by the blocks on the way down the tree, to forget on the way up
+    std::vector<Key> added;
+    bool changed = false;
+    // (block, leaving it, where its keys start in added)
+    std::vector<std::tuple<BlockId, bool, size_t>> walk{{0, false, 0}};
+    while (!walk.empty())
+    {
+        const auto [block, leaving, first_key] = walk.back();
+        walk.pop_back();
+        if (leaving)
+        {
+            for (size_t i = first_key; i < added.size(); i++)
+            {
+                available.erase(added[i]);
+            }
+            added.resize(first_key);
+            continue;
+        }
+        walk.push_back({block, true, added.size()});
+        for (const BlockId child : tree.children[block])
+        {
+            walk.push_back({child, false, 0});
+        }
+        for (Inst &inst : ir.blocks[block].insts)
+        {
+            if (inst.op != IrOp::const_ && !is_arithmetic(inst.op))
+            {
+                continue;
+            }
+            Key key{.op = inst.op, .type = inst.type, .checks = inst.checks, .b = inst.b, .c = inst.c};
+            if (is_arithmetic(inst.op))
+            {
+                inst.a = replaced[inst.a];
+                inst.b = replaced[inst.b];
+                key.a = inst.a;
+                key.b = inst.b;
+                // the same either way round
+                if ((inst.op == IrOp::add || inst.op == IrOp::mul) && key.a > key.b)
+                {
+                    std::swap(key.a, key.b);
+                }
+            }
+            const auto [found, inserted] = available.try_emplace(key, inst.dst);
+            if (inserted)
+            {
+                added.push_back(key);
+            }
+            else
+            {
+                replaced[inst.dst] = found->second;
+                changed = true;
+            }
+        }
+    }
+    if (!changed)
+    {
+        return false;
+    }
+    for (Block &block : ir.blocks)
+    {
+        std::erase_if(block.insts, [&](const Inst &inst)
+                      { return inst.dst != no_vreg && replaced[inst.dst] != inst.dst; });
+        for (Inst &inst : block.insts)
+        {
+            if (inst.op == IrOp::branch || inst.op == IrOp::exit || is_arithmetic(inst.op))
+            {
+                inst.a = replaced[inst.a];
+                inst.b = is_arithmetic(inst.op) ? replaced[inst.b] : inst.b;
+            }
+        }
+    }
+    return true;
+}
+
+inline constexpr std::array<IrPass, 4> ir_passes{{
+    {"const-fold", fold_constants, true},
+    {"simplify-cfg", simplify_cfg, false},
+    {"cse", eliminate_common_subexprs, true},
+    {"dce", eliminate_dead_code, true},
+}};
+
+// Instructions and blocks in the IR
+struct IrSize
+{
+    size_t insts = 0;
+    size_t blocks = 0;
+};
+
+inline IrSize ir_size(const IrProg &ir)
+{
+    IrSize size{.blocks = ir.blocks.size()};
+    for (const Block &block : ir.blocks)
+    {
+        size.insts += block.insts.size();
+    }
+    return size;
+}
+
+// Wall time of each stage of a build, and for the ones that work on the
+// IR how much bigger or smaller they left it, printed to stderr
+class PassTimings
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    inline void add(const std::string_view name, const Clock::time_point start, const std::optional<IrSize> before,
+                    const std::optional<IrSize> after)
+    {
+        m_rows.push_back({std::string(name), std::chrono::duration<double, std::milli>(Clock::now() - start).count(), before, after});
+    }
+
+    inline void print() const
+    {
+        std::fprintf(stderr, "%-14s %10s %24s %20s\n", "pass", "time (ms)", "insts", "blocks");
+        double total = 0;
+        for (const Row &row : m_rows)
+        {
+            total += row.ms;
+            std::fprintf(stderr, "%-14s %10.3f", row.name.c_str(), row.ms);
+            if (row.after.has_value())
+            {
+                const IrSize before = row.before.value_or(IrSize{});
+                const IrSize after = row.after.value();
+                std::fprintf(stderr, " %10zu %+13lld %8zu %+11lld", after.insts,
+                             static_cast<long long>(after.insts) - static_cast<long long>(before.insts), after.blocks,
+                             static_cast<long long>(after.blocks) - static_cast<long long>(before.blocks));
+            }
+            std::fprintf(stderr, "\n");
+        }
+        std::fprintf(stderr, "%-14s %10.3f\n", "total", total);
+    }
+
+private:
+    struct Row
+    {
+        std::string name;
+        double ms;
+        std::optional<IrSize> before;
+        std::optional<IrSize> after;
+    };
+    std::vector<Row> m_rows;
+};
+
+// Runs a pipeline of passes over the IR, in order
+// After a pass that changed the blocks or edges the analyses are worked
+// out again when they are next needed
+class PassManager
+{
+public:
+    using Pipeline = std::vector<const IrPass *>;
+
+    inline explicit PassManager(Pipeline pipeline)
+        : m_pipeline(std::move(pipeline))
+    {
+    }
+
+    // The passes of -O1 and -O2 (-O0 doesn't make IR at all)
+    // -O1 only does what pays for itself in compile time, -O2 also looks
+    // for repeated computations
+    static inline Pipeline preset(const int level)
+    {
+        return parse(level >= 2 ? "const-fold,simplify-cfg,cse,dce" : "const-fold,simplify-cfg,dce").value();
+    }
+
+    // "name,name,...", empty if a name isn't a pass
+    static inline std::optional<Pipeline> parse(const std::string_view list)
+    {
+        Pipeline pipeline;
+        size_t begin = 0;
+        while (begin < list.size())
+        {
+            const size_t end = std::min(list.find(',', begin), list.size());
+            const std::string_view name = list.substr(begin, end - begin);
+            const auto pass = std::find_if(ir_passes.begin(), ir_passes.end(), [&](const IrPass &candidate)
+                                           { return candidate.name == name; });
+            if (pass == ir_passes.end())
+            {
+                return {};
+            }
+            pipeline.push_back(&*pass);
+            begin = end + 1;
+        }
+        return pipeline;
+    }
+
+    // Checks the IR before the first pass and after each one, which costs
+    // about as much as a pass, so it is only for debugging them
+    inline void verify_each_pass()
+    {
+        m_verify = true;
+    }
+
+    // times each pass into timings if there are any
+    inline void run(IrProg &ir, PassTimings *timings) const
+    {
+        // the verifier shares the passes' analyses, so checking the IR
+        // after a pass that kept the CFG doesn't work them out again
+        IrAnalyses analyses(ir);
+        if (m_verify)
+        {
+            check_ir(ir, analyses);
+        }
+        for (const IrPass *pass : m_pipeline)
+        {
+            const auto start = PassTimings::Clock::now();
+            const std::optional<IrSize> before = timings != nullptr ? std::optional(ir_size(ir)) : std::nullopt;
+            if (pass->run(ir, analyses) && !pass->preserves_cfg)
+            {
+                analyses.invalidate_cfg();
+            }
+            if (timings != nullptr)
+            {
+                timings->add(pass->name, start, before, ir_size(ir));
+            }
+            if (m_verify)
+            {
+                check_ir(ir, analyses);
+            }
+        }
+    }
+
+private:
+    Pipeline m_pipeline;
+    bool m_verify = false;
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <exception>
+#include <ostream>
+#include <thread>
+#include "./generation.hpp"
+#include "./parallel.hpp"
+
+// Runs the tokenizer, the parser and the generator at the same time
+// The tokenizer publishes batches of tokens on its own thread, the parser
+// takes them and hands every few finished top level statements to the
+// generator on the calling thread, which writes the asm to out as soon as
+// it is produced. The asm is the same as running the stages one by one,
+// but when this throws out already holds part of it
+// A stage that runs into a CompileError ends its output early and drains
+// its input, so the stages before it can finish too. Once all threads are
+// joined the error of the earliest stage is rethrown, that is the one the
+// stages run one by one would have stopped at (the later ones may only
+// have failed because their input was cut short)
+inline void compile_pipelined(Tokenizer &tokenizer, const SymbolTable &symbols, const bool share_exprs, const bool checked, std::ostream &out)
+{
+    SpscRing<TokenBuffer> tokens(16);
+    SpscRing<NodeProg> parts(16);
+    std::exception_ptr lexer_error;
+    std::exception_ptr parser_error;
+    std::exception_ptr generator_error;
+
+    std::thread lexer([&]
+                      {
+                          try
+                          {
+                              tokenizer.tokenize_into(tokens);
+                          }
+                          catch (...)
+                          {
+                              lexer_error = std::current_exception();
+                          } });
+    std::thread parser_thread([&]
+                              {
+                                  try
+                                  {
+                                      Parser parser(tokens);
+                                      if (share_exprs)
+                                      {
+                                          parser.share_exprs();
+                                      }
+                                      while (auto part = parser.parse_part())
+                                      {
+                                          parts.push(std::move(part.value()));
+                                      }
+                                  }
+                                  catch (...)
+                                  {
+                                      parser_error = std::current_exception();
+                                      tokens.drain();
+                                  }
+                                  parts.close();
+                              });
+
+    try
+    {
+        Generator generator(symbols);
+        if (checked)
+        {
+            generator.checked_arithmetic();
+        }
+        generator.gen_start();
+        while (auto part = parts.pop())
+        {
+            generator.gen_stmts(std::move(part.value()));
+            out << generator.take_output();
+        }
+        generator.gen_end();
+        out << generator.take_output();
+    }
+    catch (...)
+    {
+        generator_error = std::current_exception();
+        parts.drain();
+    }
+
+    parser_thread.join();
+    lexer.join();
+    for (const std::exception_ptr &error : {lexer_error, parser_error, generator_error})
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
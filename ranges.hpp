@@ -0,0 +1,163 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include "./parser.hpp"
+
+// Value range analysis for checked arithmetic
+// Every value is tracked as the closed interval of the integers it can
+// be. The bounds are 128 bit so every u64 and i64 value, and the exact
+// result of adding or subtracting two of them, can be represented
+using Wide = __int128;
+
+struct Interval
+{
+    Wide lo = 0;
+    Wide hi = 0;
+
+    static Interval point(const Wide value)
+    {
+        return {value, value};
+    }
+
+    // every value of the type
+    static Interval of(const IntType type)
+    {
+        if (!is_signed(type))
+        {
+            return {0, static_cast<Wide>(type_max(type))};
+        }
+        const auto max = static_cast<Wide>(type_max(type));
+        return {-max - 1, max};
+    }
+
+    // the value of the bits of a value of the type, see wrap_to
+    static Interval point_of(const uint64_t bits, const IntType type)
+    {
+        return point(is_signed(type) ? static_cast<Wide>(static_cast<int64_t>(bits)) : static_cast<Wide>(bits));
+    }
+
+    [[nodiscard]] bool contains(const Wide value) const
+    {
+        return lo <= value && value <= hi;
+    }
+
+    [[nodiscard]] bool within(const Interval &outer) const
+    {
+        return outer.lo <= lo && hi <= outer.hi;
+    }
+};
+
+// What a binary operation on values in lhs and rhs can do
+struct OpRange
+{
+    // the values it gives when it doesn't trap
+    Interval result;
+    // the exact result might not fit the type, for a division that is
+    // the minimum of a signed type divided by -1
+    bool may_overflow = false;
+    bool may_divide_by_zero = false;
+};
+
+// Result range of op on operands in lhs and rhs (both inside the range of
+// type). An operation that may overflow either traps or wraps around
+// anywhere in the type, depending on checked
+inline OpRange op_range(const NodeKind op, const Interval &lhs, const Interval &rhs, const IntType type, const bool checked)
+{
+    const Interval bounds = Interval::of(type);
+    OpRange range;
+    // the exact result is known to be in [lo, hi] unless exact is false
+    bool exact = true;
+    Wide lo = 0;
+    Wide hi = 0;
+    const auto corners = [&](const Wide a_lo, const Wide a_hi, const Wide b_lo, const Wide b_hi, auto &&apply)
+    {
+        bool first = true;
+        for (const Wide a : {a_lo, a_hi})
+        {
+            for (const Wide b : {b_lo, b_hi})
+            {
+                Wide value;
+                if (!apply(a, b, value))
+                {
+                    exact = false;
+                    return;
+                }
+                lo = first ? value : std::min(lo, value);
+                hi = first ? value : std::max(hi, value);
+                first = false;
+            }
+        }
+    };
+
+    switch (op)
+    {
+    case NodeKind::bin_add:
+        lo = lhs.lo + rhs.lo;
+        hi = lhs.hi + rhs.hi;
+        break;
+    case NodeKind::bin_sub:
+        lo = lhs.lo - rhs.hi;
+        hi = lhs.hi - rhs.lo;
+        break;
+    case NodeKind::bin_multi:
+        corners(lhs.lo, lhs.hi, rhs.lo, rhs.hi, [](const Wide a, const Wide b, Wide &value)
+                { return !__builtin_mul_overflow(a, b, &value); });
+        break;
+    default:
+    {
+        range.may_divide_by_zero = rhs.contains(0);
+        // Truncating division is monotonic in the dividend, and in the
+        // divisor on either side of zero, so the extremes are at the ends
+        // of the positive and the negative part of the divisor's range
+        const auto divide = [](const Wide a, const Wide b, Wide &value)
+        {
+            value = a / b;
+            return true;
+        };
+        bool first = true;
+        const auto add_part = [&](const Wide b_lo, const Wide b_hi)
+        {
+            const Wide old_lo = lo;
+            const Wide old_hi = hi;
+            corners(lhs.lo, lhs.hi, b_lo, b_hi, divide);
+            if (!first)
+            {
+                lo = std::min(lo, old_lo);
+                hi = std::max(hi, old_hi);
+            }
+            first = false;
+        };
+        if (rhs.hi >= 1)
+        {
+            add_part(std::max<Wide>(rhs.lo, 1), rhs.hi);
+        }
+        if (rhs.lo <= -1)
+        {
+            add_part(rhs.lo, std::min<Wide>(rhs.hi, -1));
+        }
+        if (first)
+        {
+            // only ever divides by zero
+            range.result = Interval::point(0);
+            return range;
+        }
+        break;
+    }
+    }
+
+    range.may_overflow = !exact || lo < bounds.lo || hi > bounds.hi;
+    if (!range.may_overflow)
+    {
+        range.result = {lo, hi};
+    }
+    else if (checked && exact && lo <= bounds.hi && hi >= bounds.lo)
+    {
+        // whatever doesn't fit traps
+        range.result = {std::max(lo, bounds.lo), std::min(hi, bounds.hi)};
+    }
+    else
+    {
+        range.result = bounds;
+    }
+    return range;
+}
@@ -1,6 +1,6 @@
 echo "Compiling..."
 
-g++ -std=c++20 main.cpp
+g++ -std=c++20 -pthread main.cpp
 sleep 1
 ./a.out askiLang.al
 
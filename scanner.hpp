@@ -0,0 +1,282 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define ASKI_SCANNER_X86 1
+#endif
+
+// Character classes used by the Tokenizer
+// Same meaning as std::isspace / std::isalpha / std::isdigit in the "C" locale
+// but as a plain table lookup
+enum class CharClass : uint8_t
+{
+    other,
+    space,
+    alpha,
+    digit
+};
+
+inline constexpr std::array<CharClass, 256> char_classes = []
+{
+    std::array<CharClass, 256> table{};
+    for (int c = 0; c < 256; c++)
+    {
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+            table[c] = CharClass::space;
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            table[c] = CharClass::alpha;
+        else if (c >= '0' && c <= '9')
+            table[c] = CharClass::digit;
+    }
+    return table;
+}();
+
+inline CharClass char_class(const char c)
+{
+    return char_classes[static_cast<unsigned char>(c)];
+}
+
+// Bitmasks for one 64 byte block of the source
+// bit i describes the byte at block base + i
+// comment marks the '/' of a "//" or "/*", for the last byte of the block
+// that depends on the first byte of the next one, see Scanner::block
+struct BlockMasks
+{
+    uint64_t space;
+    uint64_t alnum;
+    uint64_t digit;
+    uint64_t comment;
+};
+
+namespace scanner_detail
+{
+    // a '/' with a '/' or '*' right after it in the same block
+    inline uint64_t comment_starts(const uint64_t slash, const uint64_t star)
+    {
+        return slash & ((slash | star) >> 1);
+    }
+
+    inline void classify_scalar(const char *p, BlockMasks &out)
+    {
+        out = {};
+        uint64_t slash = 0;
+        uint64_t star = 0;
+        for (int i = 0; i < 64; i++)
+        {
+            const uint64_t bit = uint64_t{1} << i;
+            slash |= p[i] == '/' ? bit : 0;
+            star |= p[i] == '*' ? bit : 0;
+            switch (char_class(p[i]))
+            {
+            case CharClass::space:
+                out.space |= bit;
+                break;
+            case CharClass::digit:
+                out.digit |= bit;
+                out.alnum |= bit;
+                break;
+            case CharClass::alpha:
+                out.alnum |= bit;
+                break;
+            default:
+                break;
+            }
+        }
+        out.comment = comment_starts(slash, star);
+    }
+
+#ifdef ASKI_SCANNER_X86
+    // SSE2 only has signed byte compares, so ranges are checked
+    // with unsigned min/max instead: lo <= v <= hi
+    inline __m128i in_range_sse2(const __m128i v, const char lo, const char hi)
+    {
+        const __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(lo)), v);
+        const __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(hi)), v);
+        return _mm_and_si128(ge, le);
+    }
+
+    inline __m128i eq_sse2(const __m128i v, const char c)
+    {
+        return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+    }
+
+    inline void classify_sse2(const char *p, BlockMasks &out)
+    {
+        out = {};
+        uint64_t slash = 0;
+        uint64_t star = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i * 16));
+            const __m128i digit = in_range_sse2(v, '0', '9');
+            const __m128i alpha = in_range_sse2(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+            const __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range_sse2(v, '\t', '\r'));
+            const int shift = i * 16;
+            out.space |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(space))) << shift;
+            out.digit |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(digit))) << shift;
+            out.alnum |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_or_si128(alpha, digit)))) << shift;
+            slash |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(eq_sse2(v, '/')))) << shift;
+            star |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(eq_sse2(v, '*')))) << shift;
+        }
+        out.comment = comment_starts(slash, star);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i in_range_avx2(const __m256i v, const char lo, const char hi)
+    {
+        const __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(lo)), v);
+        const __m256i le = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(hi)), v);
+        return _mm256_and_si256(ge, le);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i eq_avx2(const __m256i v, const char c)
+    {
+        return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+    }
+
+    __attribute__((target("avx2"))) inline void classify_avx2(const char *p, BlockMasks &out)
+    {
+        out = {};
+        uint64_t slash = 0;
+        uint64_t star = 0;
+        for (int i = 0; i < 2; i++)
+        {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i * 32));
+            const __m256i digit = in_range_avx2(v, '0', '9');
+            const __m256i alpha = in_range_avx2(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z');
+            const __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), in_range_avx2(v, '\t', '\r'));
+            const int shift = i * 32;
+            out.space |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(space))) << shift;
+            out.digit |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(digit))) << shift;
+            out.alnum |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(alpha, digit)))) << shift;
+            slash |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(eq_avx2(v, '/')))) << shift;
+            star |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(eq_avx2(v, '*')))) << shift;
+        }
+        out.comment = comment_starts(slash, star);
+    }
+#endif
+
+    using ClassifyFn = void (*)(const char *, BlockMasks &);
+
+    // picked once at startup depending on what the cpu supports
+    inline ClassifyFn pick_classify()
+    {
+#ifdef ASKI_SCANNER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return classify_avx2;
+        }
+        return classify_sse2;
+#else
+        return classify_scalar;
+#endif
+    }
+
+    inline const ClassifyFn classify = pick_classify();
+}
+
+// Structural scanner over the source buffer
+// Works like the first stage of simdjson, every 64 byte block is
+// classified at once into whitespace / identifier / digit / comment
+// start bitmasks and the Tokenizer walks those masks to find
+// where runs end instead of looking at one byte at a time
+class Scanner
+{
+public:
+    inline explicit Scanner(std::string_view src)
+        : m_src(src)
+    {
+    }
+
+    // point the scanner at a new buffer, used when a streaming
+    // Tokenizer refills its window
+    inline void reset(const std::string_view src)
+    {
+        m_src = src;
+        m_block_base = SIZE_MAX;
+    }
+
+    // index of the first non whitespace byte at or after pos
+    [[nodiscard]] inline size_t skip_space(const size_t pos)
+    {
+        return skip_run(pos, &BlockMasks::space);
+    }
+
+    // index of the first byte at or after pos that can't be part of an identifier
+    [[nodiscard]] inline size_t skip_alnum(const size_t pos)
+    {
+        return skip_run(pos, &BlockMasks::alnum);
+    }
+
+    // index of the first non digit byte at or after pos
+    [[nodiscard]] inline size_t skip_digits(const size_t pos)
+    {
+        return skip_run(pos, &BlockMasks::digit);
+    }
+
+    // whether a "//" or "/*" starts at pos, never for the last byte of
+    // the buffer
+    [[nodiscard]] inline bool is_comment(const size_t pos)
+    {
+        return test(pos, &BlockMasks::comment);
+    }
+
+private:
+    inline size_t skip_run(size_t pos, uint64_t BlockMasks::*mask)
+    {
+        while (pos < m_src.size())
+        {
+            const size_t base = pos & ~size_t{63};
+            const BlockMasks &masks = block(base);
+            // bits past the end of the source are never set so the
+            // run always stops there
+            const uint64_t outside = ~(masks.*mask) >> (pos - base);
+            if (outside != 0)
+            {
+                return pos + __builtin_ctzll(outside);
+            }
+            pos = base + 64;
+        }
+        return m_src.size();
+    }
+
+    inline bool test(const size_t pos, uint64_t BlockMasks::*mask)
+    {
+        const size_t base = pos & ~size_t{63};
+        return (block(base).*mask >> (pos - base)) & 1;
+    }
+
+    inline const BlockMasks &block(const size_t base)
+    {
+        if (base != m_block_base)
+        {
+            if (base + 64 <= m_src.size())
+            {
+                scanner_detail::classify(m_src.data() + base, m_masks);
+            }
+            else
+            {
+                // last partial block, pad with zeros which belong to no class
+                char tail[64] = {};
+                std::memcpy(tail, m_src.data() + base, m_src.size() - base);
+                scanner_detail::classify(tail, m_masks);
+            }
+            // a comment can start on the last byte of the block
+            const size_t last = base + 63;
+            if (last + 1 < m_src.size() && m_src[last] == '/' && (m_src[last + 1] == '/' || m_src[last + 1] == '*'))
+            {
+                m_masks.comment |= uint64_t{1} << 63;
+            }
+            m_block_base = base;
+        }
+        return m_masks;
+    }
+
+    std::string_view m_src;
+    size_t m_block_base = SIZE_MAX;
+    BlockMasks m_masks{};
+};
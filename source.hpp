@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view of a source file.
+// Regular files are memory mapped so the tokens can point straight
+// into the mapping instead of copying the text around.
+// Anything that can't be mapped (pipes, empty files) is read into
+// a string instead, the view works the same way in both cases
+class SourceFile
+{
+public:
+    inline explicit SourceFile(const char *path)
+    {
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Unable to open " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                // we only ever walk the file front to back
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const char *>(data);
+                m_size = st.st_size;
+                m_mapped = true;
+            }
+        }
+        if (!m_mapped)
+        {
+            read_all(fd);
+            m_data = m_fallback.data();
+            m_size = m_fallback.size();
+        }
+        close(fd);
+    }
+
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    inline ~SourceFile()
+    {
+        if (m_mapped)
+        {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+    }
+
+    // the view stays valid for as long as the SourceFile is alive
+    [[nodiscard]] inline std::string_view view() const
+    {
+        return {m_data, m_size};
+    }
+
+private:
+    inline void read_all(const int fd)
+    {
+        char chunk[64 * 1024];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+        {
+            m_fallback.append(chunk, n);
+        }
+        if (n < 0)
+        {
+            std::cerr << "Unable to read source file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::string m_fallback;
+};
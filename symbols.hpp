@@ -0,0 +1,140 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include "./arena.hpp"
+
+// Interned identifier spellings are referred to by their index in the SymbolTable
+using Symbol = uint32_t;
+
+// Each distinct spelling gets stored once and is given a 32 bit id,
+// so the rest of the compiler compares names as plain integers
+// Looking up a name is safe while another thread adds new ones, as long
+// as the symbol was handed over after it was interned (e.g. through a
+// SpscRing), the names never move once stored
+class SymbolTable
+{
+public:
+    inline SymbolTable()
+        : m_slots(64, 0)
+    {
+    }
+
+    SymbolTable(const SymbolTable &) = delete;
+    SymbolTable &operator=(const SymbolTable &) = delete;
+
+    // copies the text into the table if it isn't there yet
+    inline Symbol intern(const std::string_view text)
+    {
+        return insert(text, true);
+    }
+
+    // same as intern but keeps pointing at text instead of copying it,
+    // text has to outlive the table (e.g. the mapped source file)
+    inline Symbol intern_view(const std::string_view text)
+    {
+        return insert(text, false);
+    }
+
+    [[nodiscard]] inline std::string_view name(const Symbol symbol) const
+    {
+        const auto [block, index] = locate(symbol);
+        return m_names[block][index];
+    }
+
+    [[nodiscard]] inline size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    static inline uint32_t hash(const std::string_view text)
+    {
+        // FNV-1a, identifiers are short so this is plenty
+        uint32_t h = 2166136261u;
+        for (const char c : text)
+        {
+            h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return h;
+    }
+
+    inline Symbol insert(const std::string_view text, const bool copy)
+    {
+        const uint32_t h = hash(text);
+        const size_t mask = m_slots.size() - 1;
+        size_t slot = h & mask;
+        // open addressing with linear probing, slots hold symbol + 1 (0 is empty)
+        while (m_slots[slot] != 0)
+        {
+            const Symbol existing = m_slots[slot] - 1;
+            if (m_hashes[existing] == h && name(existing) == text)
+            {
+                return existing;
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        const auto symbol = static_cast<Symbol>(m_size);
+        const auto [block, index] = locate(symbol);
+        if (index == 0)
+        {
+            m_names[block] = std::make_unique<std::string_view[]>(first_block << block);
+        }
+        m_names[block][index] = copy ? store(text) : text;
+        m_size++;
+        m_hashes.push_back(h);
+        m_slots[slot] = symbol + 1;
+        // keep the table at most half full
+        if (m_size * 2 > m_slots.size())
+        {
+            grow();
+        }
+        return symbol;
+    }
+
+    inline void grow()
+    {
+        std::vector<uint32_t> slots(m_slots.size() * 2, 0);
+        const size_t mask = slots.size() - 1;
+        for (Symbol symbol = 0; symbol < m_size; symbol++)
+        {
+            size_t slot = m_hashes[symbol] & mask;
+            while (slots[slot] != 0)
+            {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = symbol + 1;
+        }
+        m_slots = std::move(slots);
+    }
+
+    // the arena never moves what it handed out, so the views stay valid
+    inline std::string_view store(const std::string_view text)
+    {
+        char *dest = m_text.alloc_array<char>(text.size());
+        std::memcpy(dest, text.data(), text.size());
+        return {dest, text.size()};
+    }
+
+    // block k holds first_block << k names, so growing never moves any
+    static constexpr size_t first_block = 64;
+
+    static inline std::pair<size_t, size_t> locate(const Symbol symbol)
+    {
+        const uint64_t biased = uint64_t{symbol} + first_block;
+        const size_t block = 63 - __builtin_clzll(biased) - __builtin_ctzll(first_block);
+        return {block, biased - (first_block << block)};
+    }
+
+    ArenaAllocator m_text;
+
+    std::array<std::unique_ptr<std::string_view[]>, 27> m_names;
+    size_t m_size = 0;
+    std::vector<uint32_t> m_hashes;
+    std::vector<uint32_t> m_slots;
+};
@@ -0,0 +1,65 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "../generation.hpp"
+#include "../lowering.hpp"
+
+// With checked arithmetic a let or exit that overflows (or divides by
+// zero) compiles to code that traps when it runs, only a const that does
+// is a mistake in the program
+static int failures = 0;
+
+// why src doesn't go through both back ends with checked arithmetic,
+// empty if it does
+static std::string compile_error(const std::string &src)
+{
+    try
+    {
+        SymbolTable symbols;
+        const NodeProg prog = Parser(Tokenizer(src, symbols).tokenize()).parseProg().value();
+        Generator generator(prog, symbols);
+        generator.checked_arithmetic();
+        static_cast<void>(generator.gen_prog());
+        IrLowering lowering(prog, symbols);
+        lowering.checked_arithmetic();
+        static_cast<void>(lowering.lower());
+        return {};
+    }
+    catch (const CompileError &error)
+    {
+        return error.what();
+    }
+}
+
+static void expect(const char *what, const std::string &src, const bool expected)
+{
+    const std::string error = compile_error(src);
+    if (error.empty() != expected)
+    {
+        std::cerr << what << ": expected it " << (expected ? "to compile, got " + error : "not to compile") << std::endl;
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        std::cerr << "usage: checked_test <askiLang.al>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::ifstream file(argv[1]);
+    std::stringstream example;
+    example << file.rdbuf();
+    // 2+2-(3*5) goes below zero in u64
+    expect("askiLang.al", example.str(), true);
+    expect("overflow in a branch that never runs", "if (0) {\n    let y = 0 - 1;\n    exit(y);\n}\nexit(3);\n", true);
+    expect("overflow in a let", "let y = 0 - 1;\nexit(y);\n", true);
+    expect("overflow in an exit", "exit(0 - 1);\n", true);
+    expect("division by zero in a let", "let y = 1 / 0;\nexit(y);\n", true);
+    expect("overflow in a const", "const c = 0 - 1;\nexit(c);\n", false);
+    expect("overflow in a typed const", "const c: u8 = 200 + 100;\nexit(c);\n", false);
+    expect("division by zero in a const", "const c = 1 / 0;\nexit(c);\n", false);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
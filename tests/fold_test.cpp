@@ -0,0 +1,38 @@
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include "../typecheck.hpp"
+
+// fold_bin_expr has to agree with what the generated code does, or a
+// constant would get a value the same expression never has at run time
+static int failures = 0;
+
+static void expect(const char *what, const std::optional<uint64_t> got, const std::optional<uint64_t> expected)
+{
+    if (got != expected)
+    {
+        std::cerr << what << ": got " << (got ? std::to_string(static_cast<int64_t>(*got)) : "not constant")
+                  << ", expected " << (expected ? std::to_string(static_cast<int64_t>(*expected)) : "not constant") << std::endl;
+        failures++;
+    }
+}
+
+int main()
+{
+    const uint64_t minus_one = UINT64_MAX;
+    // idiv faults on the minimum divided by -1 in 32 and 64 bits
+    expect("i32 min / -1", fold_bin_expr(NodeKind::bin_div, wrap_to(uint64_t{1} << 31, IntType::i32), minus_one, IntType::i32), {});
+    expect("i64 min / -1", fold_bin_expr(NodeKind::bin_div, uint64_t{1} << 63, minus_one, IntType::i64), {});
+    // narrower types are divided in 32 bits, where it just wraps
+    expect("i8 min / -1", fold_bin_expr(NodeKind::bin_div, wrap_to(0x80, IntType::i8), minus_one, IntType::i8), wrap_to(0x80, IntType::i8));
+    expect("i16 min / -1", fold_bin_expr(NodeKind::bin_div, wrap_to(0x8000, IntType::i16), minus_one, IntType::i16), wrap_to(0x8000, IntType::i16));
+    // one off the minimum is fine at every width
+    expect("i32 (min + 1) / -1", fold_bin_expr(NodeKind::bin_div, wrap_to((uint64_t{1} << 31) + 1, IntType::i32), minus_one, IntType::i32),
+           (uint64_t{1} << 31) - 1);
+    expect("i64 (min + 1) / -1", fold_bin_expr(NodeKind::bin_div, (uint64_t{1} << 63) + 1, minus_one, IntType::i64), (uint64_t{1} << 63) - 1);
+    expect("i32 min / 1", fold_bin_expr(NodeKind::bin_div, wrap_to(uint64_t{1} << 31, IntType::i32), 1, IntType::i32),
+           wrap_to(uint64_t{1} << 31, IntType::i32));
+    expect("u32 / 0", fold_bin_expr(NodeKind::bin_div, 7, 0, IntType::u32), {});
+    expect("u8 wraps", fold_bin_expr(NodeKind::bin_add, 200, 100, IntType::u8), 44);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,218 +1,862 @@
-#pragma once
-#include <string>
-#include <vector>
-#include <optional>
-enum class TokenType
-{
-    exit,
-    int_lit,
-    semi,
-    open_paran,
-    close_paran,
-    ident,
-    let,
-    eq,
-    plus,
-    star,
-    minus,
-    fslash,
-    open_curly,
-    close_curly,
-    if_,
-    elif,
-    else_
-};
-
-inline std::optional<int> binExpr_prec(const TokenType type)
-{
-    switch (type)
-    {
-    case TokenType::star:
-    case TokenType::fslash:
-        return 1;
-    case TokenType::plus:
-    case TokenType::minus:
-        return 0;
-    default:
-        return {};
-    }
-}
-
-struct Token
-{
-    TokenType type;
-    std::optional<std::string> value{};
-};
-
-class Tokenizer
-{
-public:
-    inline explicit Tokenizer(std::string src)
-        : m_src(std::move(src))
-    {
-    }
-
-    // Tokenize function which is used convert the code into tokenize and
-    // Extract the tokens from it
-    inline std::vector<Token> tokenize()
-    {
-        std::vector<Token> tokens;
-        std::string buf;
-        while (peek().has_value())
-        {
-            // cant able to use switch statement here
-            // because switch requires constant expression to be
-            // evaluated
-            if (std::isalpha(peek().value()))
-            {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isalnum(peek().value()))
-                {
-                    buf.push_back(consume());
-                }
-                if (buf == "exit")
-                {
-                    tokens.push_back({.type = TokenType::exit});
-                    buf.clear();
-                }
-                else if (buf == "let")
-                {
-                    tokens.push_back({.type = TokenType::let});
-                    buf.clear();
-                }
-                else if (buf == "if")
-                {
-                    tokens.push_back({.type = TokenType::if_});
-                    buf.clear();
-                }
-                else if (buf == "elif") {
-                    tokens.push_back({.type = TokenType::elif});
-                    buf.clear();
-                }else if (buf == "else") {
-                    tokens.push_back({.type = TokenType::else_});
-                    buf.clear();
-                }
-                // ident can be any so don't want to apply if else
-                else
-                {
-                    tokens.push_back({.type = TokenType::ident, .value = buf});
-                    buf.clear();
-                }
-            }
-            else if (std::isdigit(peek().value()))
-            {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value()))
-                {
-                    buf.push_back(consume());
-                }
-                tokens.push_back({.type = TokenType::int_lit, .value = buf});
-                buf.clear();
-            }
-            else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '/') {
-                consume();
-                consume();
-                while (peek().has_value() && peek(1).value() != '\n') {
-                    consume();
-                }
-            }
-            else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '*') {
-                consume();
-                consume();
-                while (peek().has_value() ) {
-                    if ( peek().value() == '*' && peek(1).has_value() && peek(1).value() == '/') {
-                        break;
-                    }
-                    consume();
-                }
-                if (peek().has_value()) {
-                    consume();
-                }
-                if (peek().has_value()) {
-                    consume();
-                }
-            }
-            else if (peek().value() == '(')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::open_paran});
-            }
-            else if (peek().value() == ')')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::close_paran});
-            }
-            else if (peek().value() == ';')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::semi});
-            }
-            else if (std::isspace(peek().value()))
-            {
-                consume();
-            }
-            else if (peek().value() == '=')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::eq});
-            }
-            else if (peek().value() == '+')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::plus});
-            }
-            else if (peek().value() == '*')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::star});
-            }
-            else if (peek().value() == '-')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::minus});
-            }
-            else if (peek().value() == '/')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::fslash});
-            }
-            else if (peek().value() == '{')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::open_curly});
-            }
-            else if (peek().value() == '}')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::close_curly});
-            }
-            else
-            {
-                std::cerr << "You messed up! Unexpected character: '" << peek().value() << "'" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-        }
-        m_index = 0;
-        return tokens;
-    }
-
-private:
-    [[nodiscard]] inline std::optional<char> peek(const int offset = 0) const
-    {
-        if (m_index + offset >= m_src.length())
-        {
-            return {};
-        }
-        else
-        {
-            return m_src.at(m_index + offset);
-        }
-    }
-    inline char consume()
-    {
-        return m_src.at(m_index++);
-    }
-
-    const std::string m_src;
-    size_t m_index = 0;
-};
\ No newline at end of file
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <unistd.h>
+#include "./errors.hpp"
+#include "./parallel.hpp"
+#include "./scanner.hpp"
+#include "./symbols.hpp"
+#include "./types.hpp"
+enum class TokenType : uint8_t
+{
+    exit,
+    int_lit,
+    semi,
+    open_paran,
+    close_paran,
+    ident,
+    let,
+    eq,
+    plus,
+    star,
+    minus,
+    fslash,
+    open_curly,
+    close_curly,
+    if_,
+    elif,
+    else_,
+    colon,
+    const_,
+    // value is the IntType
+    type_name,
+};
+
+inline std::optional<int> binExpr_prec(const TokenType type)
+{
+    switch (type)
+    {
+    case TokenType::star:
+    case TokenType::fslash:
+        return 1;
+    case TokenType::plus:
+    case TokenType::minus:
+        return 0;
+    default:
+        return {};
+    }
+}
+
+struct Keyword
+{
+    std::string_view spelling;
+    TokenType type;
+    // value of the token, the IntType of type names
+    Symbol value = 0;
+};
+
+// The one list of keywords, everything below is generated from it
+inline constexpr std::array keywords = {
+    Keyword{"exit", TokenType::exit},
+    Keyword{"let", TokenType::let},
+    Keyword{"if", TokenType::if_},
+    Keyword{"elif", TokenType::elif},
+    Keyword{"else", TokenType::else_},
+    Keyword{"const", TokenType::const_},
+    Keyword{"u8", TokenType::type_name, static_cast<Symbol>(IntType::u8)},
+    Keyword{"u16", TokenType::type_name, static_cast<Symbol>(IntType::u16)},
+    Keyword{"u32", TokenType::type_name, static_cast<Symbol>(IntType::u32)},
+    Keyword{"u64", TokenType::type_name, static_cast<Symbol>(IntType::u64)},
+    Keyword{"i8", TokenType::type_name, static_cast<Symbol>(IntType::i8)},
+    Keyword{"i16", TokenType::type_name, static_cast<Symbol>(IntType::i16)},
+    Keyword{"i32", TokenType::type_name, static_cast<Symbol>(IntType::i32)},
+    Keyword{"i64", TokenType::type_name, static_cast<Symbol>(IntType::i64)},
+    Keyword{"bool", TokenType::type_name, static_cast<Symbol>(IntType::bool_)},
+};
+
+// Perfect hash over a keyword list
+// The table is a power of two at least twice as big as the list and the
+// seed is searched at compile time until no two keywords share a slot,
+// so a lookup is one hash plus one compare no matter how many keywords there are
+// (bench/keyword_bench.cpp builds it over longer lists to check that)
+template <const auto &List>
+class KeywordTable
+{
+public:
+    // the keyword spelled word, nullptr if it is none
+    static inline const Keyword *find(const std::string_view word)
+    {
+        if (word.size() < limits.min_len || word.size() > limits.max_len)
+        {
+            return nullptr;
+        }
+        const Keyword &entry = table[hash(word, seed)];
+        if (entry.spelling.size() == word.size() && std::memcmp(entry.spelling.data(), word.data(), word.size()) == 0)
+        {
+            return &entry;
+        }
+        return nullptr;
+    }
+
+private:
+    static constexpr size_t table_size = []
+    {
+        size_t size = 1;
+        while (size < List.size() * 2)
+            size *= 2;
+        return size;
+    }();
+
+    // mixes the length with the first, middle and last byte
+    static constexpr size_t hash(const std::string_view s, const uint32_t seed)
+    {
+        uint32_t h = seed ^ static_cast<uint32_t>(s.size());
+        h = (h ^ static_cast<unsigned char>(s.front())) * 0x01000193u;
+        h = (h ^ static_cast<unsigned char>(s[s.size() / 2])) * 0x01000193u;
+        h = (h ^ static_cast<unsigned char>(s.back())) * 0x01000193u;
+        return (h ^ (h >> 15)) & (table_size - 1);
+    }
+
+    static constexpr bool collides(const uint32_t seed)
+    {
+        std::array<bool, table_size> used{};
+        for (const Keyword &keyword : List)
+        {
+            const size_t slot = hash(keyword.spelling, seed);
+            if (used[slot])
+                return true;
+            used[slot] = true;
+        }
+        return false;
+    }
+
+    static constexpr uint32_t seed = []
+    {
+        uint32_t seed = 1;
+        while (seed < 10000 && collides(seed))
+            seed++;
+        return seed;
+    }();
+    static_assert(!collides(seed), "no perfect hash seed found for the keyword list");
+
+    struct Limits
+    {
+        size_t min_len;
+        size_t max_len;
+    };
+
+    static constexpr Limits limits = []
+    {
+        Limits limits{SIZE_MAX, 0};
+        for (const Keyword &keyword : List)
+        {
+            limits.min_len = std::min(limits.min_len, keyword.spelling.size());
+            limits.max_len = std::max(limits.max_len, keyword.spelling.size());
+        }
+        return limits;
+    }();
+
+    // empty spelling marks a free slot
+    static constexpr std::array<Keyword, table_size> table = []
+    {
+        std::array<Keyword, table_size> table{};
+        for (const Keyword &keyword : List)
+        {
+            table[hash(keyword.spelling, seed)] = keyword;
+        }
+        return table;
+    }();
+};
+
+// the keyword spelled word, nullptr if it is none
+inline const Keyword *find_keyword(const std::string_view word)
+{
+    return KeywordTable<keywords>::find(word);
+}
+
+// Smallest x86 immediate an integer literal fits in
+// imm8 / imm32 are sign extended by the cpu, uimm32 only fits a
+// zero extending 32 bit mov, everything else needs a full 64 bit mov
+enum class ImmWidth : uint8_t
+{
+    imm8,
+    imm32,
+    uimm32,
+    imm64
+};
+
+inline ImmWidth imm_width(const int64_t value)
+{
+    if (value >= INT8_MIN && value <= INT8_MAX)
+        return ImmWidth::imm8;
+    if (value >= INT32_MIN && value <= INT32_MAX)
+        return ImmWidth::imm32;
+    if (value >= 0 && value <= UINT32_MAX)
+        return ImmWidth::uimm32;
+    return ImmWidth::imm64;
+}
+
+// Decodes a run of decimal digits, empty if it doesn't fit in an int64_t
+// Eight digits at a time are combined inside one 64 bit register (SWAR)
+inline std::optional<int64_t> decode_int_lit(std::string_view digits)
+{
+    while (digits.size() > 1 && digits.front() == '0')
+    {
+        digits.remove_prefix(1);
+    }
+    // 19 digits always fit in a uint64_t, more never fit in an int64_t
+    if (digits.size() > 19)
+    {
+        return {};
+    }
+
+    uint64_t value = 0;
+    while (digits.size() >= 8)
+    {
+        uint64_t chunk;
+        std::memcpy(&chunk, digits.data(), 8);
+        chunk -= 0x3030303030303030u;
+        chunk = (chunk * 10 + (chunk >> 8)) & 0x00ff00ff00ff00ffu;
+        chunk = (chunk * 100 + (chunk >> 16)) & 0x0000ffff0000ffffu;
+        chunk = (chunk * 10000 + (chunk >> 32)) & 0x00000000ffffffffu;
+        value = value * 100000000u + chunk;
+        digits.remove_prefix(8);
+    }
+    for (const char c : digits)
+    {
+        value = value * 10 + static_cast<uint64_t>(c - '0');
+    }
+
+    if (value > static_cast<uint64_t>(INT64_MAX))
+    {
+        return {};
+    }
+    return static_cast<int64_t>(value);
+}
+
+// value is the interned spelling of ident tokens
+// int_value is the decoded value of int_lit tokens
+struct Token
+{
+    TokenType type;
+    Symbol value = 0;
+    int64_t int_value = 0;
+};
+
+// Token stream stored as parallel arrays, one byte of type and four
+// bytes of value per token (5 bytes a token, no heap blocks of its own)
+// For int_lit the value is an index into a separate array of decoded literals
+// The parser's lookahead only ever touches the dense type array
+class TokenBuffer
+{
+public:
+    inline void push(const Token token)
+    {
+        m_types.push_back(token.type);
+        if (token.type == TokenType::int_lit)
+        {
+            m_values.push_back(static_cast<uint32_t>(m_ints.size()));
+            m_ints.push_back(token.int_value);
+        }
+        else
+        {
+            m_values.push_back(token.value);
+        }
+    }
+
+    // also records where the token starts in the source
+    inline void push(const Token token, const uint32_t offset)
+    {
+        push(token);
+        m_offsets.push_back(offset);
+    }
+
+    inline void reserve(const size_t count)
+    {
+        m_types.reserve(count);
+        m_values.reserve(count);
+    }
+
+    inline void resize(const size_t count, const size_t int_count)
+    {
+        m_types.resize(count);
+        m_values.resize(count);
+        m_ints.resize(int_count);
+    }
+
+    [[nodiscard]] inline size_t size() const
+    {
+        return m_types.size();
+    }
+
+    [[nodiscard]] inline size_t int_count() const
+    {
+        return m_ints.size();
+    }
+
+    [[nodiscard]] inline TokenType type(const size_t index) const
+    {
+        return m_types[index];
+    }
+
+    [[nodiscard]] inline Symbol value(const size_t index) const
+    {
+        return m_values[index];
+    }
+
+    [[nodiscard]] inline int64_t int_value(const size_t index) const
+    {
+        return m_ints[m_values[index]];
+    }
+
+    // only there for buffers from Tokenizer::tokenize_with_offsets
+    [[nodiscard]] inline uint32_t offset(const size_t index) const
+    {
+        return m_offsets[index];
+    }
+
+    [[nodiscard]] inline Token at(const size_t index) const
+    {
+        if (m_types[index] == TokenType::int_lit)
+        {
+            return {.type = TokenType::int_lit, .int_value = int_value(index)};
+        }
+        return {.type = m_types[index], .value = m_values[index]};
+    }
+
+    // Copies all of other into this buffer starting at token index at and
+    // literal index int_at, ident symbols are translated through remap
+    // The buffer has to be resized to fit beforehand, so several of these
+    // can run at once on disjoint ranges
+    // (offsets aren't copied)
+    inline void copy_from(const TokenBuffer &other, const size_t at, const size_t int_at, const std::vector<Symbol> &remap)
+    {
+        std::copy(other.m_types.begin(), other.m_types.end(), m_types.begin() + at);
+        std::copy(other.m_ints.begin(), other.m_ints.end(), m_ints.begin() + int_at);
+        for (size_t i = 0; i < other.size(); i++)
+        {
+            const Symbol value = other.m_values[i];
+            switch (other.m_types[i])
+            {
+            case TokenType::ident:
+                m_values[at + i] = remap[value];
+                break;
+            case TokenType::int_lit:
+                m_values[at + i] = static_cast<uint32_t>(value + int_at);
+                break;
+            default:
+                m_values[at + i] = value;
+                break;
+            }
+        }
+    }
+
+    // adds all of other to the end
+    inline void append(const TokenBuffer &other)
+    {
+        const auto int_base = static_cast<uint32_t>(m_ints.size());
+        m_types.insert(m_types.end(), other.m_types.begin(), other.m_types.end());
+        m_ints.insert(m_ints.end(), other.m_ints.begin(), other.m_ints.end());
+        for (size_t i = 0; i < other.size(); i++)
+        {
+            m_values.push_back(other.m_types[i] == TokenType::int_lit ? other.m_values[i] + int_base : other.m_values[i]);
+        }
+    }
+
+    // drops the first count tokens, used by the streaming parser
+    // once it is done with them
+    inline void erase_front(const size_t count)
+    {
+        const auto dropped_ints = static_cast<uint32_t>(
+            std::count(m_types.begin(), m_types.begin() + count, TokenType::int_lit));
+        m_types.erase(m_types.begin(), m_types.begin() + count);
+        m_values.erase(m_values.begin(), m_values.begin() + count);
+        if (!m_offsets.empty())
+        {
+            m_offsets.erase(m_offsets.begin(), m_offsets.begin() + count);
+        }
+        m_ints.erase(m_ints.begin(), m_ints.begin() + dropped_ints);
+        for (size_t i = 0; i < m_types.size(); i++)
+        {
+            if (m_types[i] == TokenType::int_lit)
+            {
+                m_values[i] -= dropped_ints;
+            }
+        }
+    }
+
+private:
+    std::vector<TokenType> m_types;
+    std::vector<uint32_t> m_values;
+    std::vector<int64_t> m_ints;
+    // empty unless offsets were asked for
+    std::vector<uint32_t> m_offsets;
+};
+
+class Tokenizer
+{
+public:
+    // Tokenizes a buffer that is already fully in memory
+    // the symbol table keeps pointing into src for the spellings
+    // instead of copying them, so src has to outlive it
+    // (unless copy_symbols is set, for buffers that get edited or freed)
+    inline explicit Tokenizer(std::string_view src, SymbolTable &symbols, const bool copy_symbols = false)
+        : m_src(src),
+          m_scanner(src),
+          m_symbols(symbols),
+          m_copy_symbols(copy_symbols)
+    {
+    }
+
+    // Streaming mode, reads fd (a file or a pipe) chunk_size bytes at a time
+    // Only the unconsumed part of the current chunk is kept around, so the
+    // memory used doesn't depend on how big the input is
+    inline explicit Tokenizer(const int fd, SymbolTable &symbols, const size_t chunk_size = 64 * 1024)
+        : m_scanner({}),
+          m_symbols(symbols),
+          m_copy_symbols(true),
+          m_fd(fd),
+          m_window(chunk_size)
+    {
+    }
+
+    // Tokenize function which is used convert the code into tokenize and
+    // Extract the tokens from it
+    inline TokenBuffer tokenize()
+    {
+        TokenBuffer tokens;
+        // roughly one token every four bytes in practice
+        tokens.reserve(m_src.size() / 4);
+        while (auto token = next())
+        {
+            tokens.push(token.value());
+        }
+        return tokens;
+    }
+
+    // Same as tokenize but also records where every token starts in src,
+    // incremental reparsing maps edits to statements through these
+    inline TokenBuffer tokenize_with_offsets()
+    {
+        TokenBuffer tokens;
+        tokens.reserve(m_src.size() / 4);
+        while (auto token = next())
+        {
+            tokens.push(token.value(), static_cast<uint32_t>(m_token_start));
+        }
+        return tokens;
+    }
+
+    // Publishes the tokens in batches of batch_size for a parser running
+    // on another thread (see TokenCursor), the ring is closed at the end
+    inline void tokenize_into(SpscRing<TokenBuffer> &ring, const size_t batch_size = 4096)
+    {
+        TokenBuffer batch;
+        batch.reserve(batch_size);
+        // a mistake in the input ends the stream early, so the consumer
+        // stops instead of waiting for more
+        try
+        {
+            while (auto token = next())
+            {
+                batch.push(token.value());
+                if (batch.size() == batch_size)
+                {
+                    ring.push(std::move(batch));
+                    batch = {};
+                    batch.reserve(batch_size);
+                }
+            }
+        }
+        catch (const CompileError &)
+        {
+            ring.close();
+            throw;
+        }
+        if (batch.size() > 0)
+        {
+            ring.push(std::move(batch));
+        }
+        ring.close();
+    }
+
+    // Pulls the next token, empty once the input is exhausted
+    // Whitespace, identifier and number runs and comment starts are found
+    // through the Scanner bitmasks, so only the first byte of every token
+    // is looked at here
+    inline std::optional<Token> next()
+    {
+        while (true)
+        {
+            m_index = m_scanner.skip_space(m_index);
+            if (m_index == m_src.size())
+            {
+                if (more())
+                {
+                    refill();
+                    continue;
+                }
+                return {};
+            }
+
+            m_token_start = m_index;
+            const char c = m_src[m_index];
+            switch (char_class(c))
+            {
+            case CharClass::alpha:
+            {
+                const size_t end = m_scanner.skip_alnum(m_index + 1);
+                // the identifier might carry on in the next chunk
+                if (end == m_src.size() && more())
+                {
+                    refill();
+                    continue;
+                }
+                const std::string_view buf = m_src.substr(m_index, end - m_index);
+                m_index = end;
+                if (const Keyword *keyword = find_keyword(buf))
+                {
+                    return Token{.type = keyword->type, .value = keyword->value};
+                }
+                // ident can be any so don't want to apply if else
+                return Token{.type = TokenType::ident, .value = intern(buf)};
+            }
+            case CharClass::digit:
+            {
+                const size_t end = m_scanner.skip_digits(m_index + 1);
+                if (end == m_src.size() && more())
+                {
+                    refill();
+                    continue;
+                }
+                const std::string_view buf = m_src.substr(m_index, end - m_index);
+                m_index = end;
+                const auto value = decode_int_lit(buf);
+                if (!value.has_value())
+                {
+                    fail("Integer literal ", buf, " is too large");
+                }
+                return Token{.type = TokenType::int_lit, .int_value = value.value()};
+            }
+            default:
+                // '/' needs one byte of lookahead to tell comments apart
+                if (c == '/' && m_index + 1 == m_src.size() && more())
+                {
+                    refill();
+                    continue;
+                }
+                if (m_scanner.is_comment(m_index))
+                {
+                    m_index++;
+                    if (m_src[m_index] == '/')
+                    {
+                        skip_line_comment();
+                    }
+                    else
+                    {
+                        skip_block_comment();
+                    }
+                    continue;
+                }
+                return punctuation(c);
+            }
+        }
+    }
+
+private:
+    // single character tokens
+    inline Token punctuation(const char c)
+    {
+        m_index++;
+        switch (c)
+        {
+        case '/':
+            return Token{.type = TokenType::fslash};
+        case '(':
+            return Token{.type = TokenType::open_paran};
+        case ')':
+            return Token{.type = TokenType::close_paran};
+        case ';':
+            return Token{.type = TokenType::semi};
+        case ':':
+            return Token{.type = TokenType::colon};
+        case '=':
+            return Token{.type = TokenType::eq};
+        case '+':
+            return Token{.type = TokenType::plus};
+        case '*':
+            return Token{.type = TokenType::star};
+        case '-':
+            return Token{.type = TokenType::minus};
+        case '{':
+            return Token{.type = TokenType::open_curly};
+        case '}':
+            return Token{.type = TokenType::close_curly};
+        default:
+            fail("You messed up! Unexpected character: '", c, "'");
+        }
+    }
+
+    // line comment runs up to (not including) the newline
+    // m_index is at the second '/' of the "//"
+    inline void skip_line_comment()
+    {
+        size_t from = m_index + 1;
+        while (true)
+        {
+            const size_t end = m_src.find('\n', from);
+            if (end != std::string_view::npos)
+            {
+                m_index = end;
+                return;
+            }
+            // nothing of the comment has to be kept across the refill
+            m_index = m_src.size();
+            if (!more())
+            {
+                return;
+            }
+            refill();
+            from = 0;
+        }
+    }
+
+    // an unterminated block comment just runs to the end of the input
+    // m_index is at the '*' of the "/*"
+    inline void skip_block_comment()
+    {
+        size_t from = m_index + 1;
+        while (true)
+        {
+            const size_t end = m_src.find("*/", from);
+            if (end != std::string_view::npos)
+            {
+                m_index = end + 2;
+                return;
+            }
+            // keep the last byte in case it is the '*' of a "*/" split across chunks
+            // (as long as it isn't the '*' of the opening "/*")
+            m_index = m_src.size() > from ? m_src.size() - 1 : m_src.size();
+            if (!more())
+            {
+                m_index = m_src.size();
+                return;
+            }
+            refill();
+            from = 0;
+        }
+    }
+
+    // whether a refill can still bring in more input
+    // (never for in memory buffers)
+    [[nodiscard]] inline bool more() const
+    {
+        return m_fd >= 0 && !m_eof;
+    }
+
+    // In streaming mode moves the unconsumed tail of the window to the
+    // front and reads the next chunk after it
+    // Callers rescan from m_index afterwards since the window moved
+    inline void refill()
+    {
+        const size_t tail = m_src.size() - m_index;
+        // a single token bigger than the whole window, make room for it
+        if (tail == m_window.size())
+        {
+            m_window.resize(m_window.size() * 2);
+        }
+        // (m_src always starts at the front of the window here)
+        std::memmove(m_window.data(), m_window.data() + m_index, tail);
+
+        ssize_t n;
+        do
+        {
+            n = read(m_fd, m_window.data() + tail, m_window.size() - tail);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0)
+        {
+            fail("Unable to read input");
+        }
+        if (n == 0)
+        {
+            m_eof = true;
+        }
+
+        m_src = std::string_view(m_window.data(), tail + n);
+        m_index = 0;
+        m_scanner.reset(m_src);
+    }
+
+    // token text in a streaming window is overwritten by the next refill
+    // so the symbol table copies it, in memory buffers are used as they are
+    inline Symbol intern(const std::string_view text)
+    {
+        return m_copy_symbols ? m_symbols.intern(text) : m_symbols.intern_view(text);
+    }
+
+    std::string_view m_src;
+    size_t m_index = 0;
+    // where the token last returned by next() starts
+    size_t m_token_start = 0;
+    Scanner m_scanner;
+    SymbolTable &m_symbols;
+    bool m_copy_symbols = false;
+
+    int m_fd = -1;
+    bool m_eof = false;
+    std::vector<char> m_window;
+};
+
+// Handle to a token inside a TokenCursor, only valid until the cursor moves on
+using TokenRef = size_t;
+
+// Read position in a token stream for the Parser
+// Lookahead only reads the type array and consume hands back a TokenRef,
+// so nothing gets copied unless a payload is actually asked for
+class TokenCursor
+{
+public:
+    inline explicit TokenCursor(TokenBuffer tokens)
+        : m_tokens(std::move(tokens)),
+          m_end(m_tokens.size())
+    {
+    }
+
+    // Streaming mode, pulls tokens from the tokenizer as they're needed
+    inline explicit TokenCursor(Tokenizer &tokenizer)
+        : m_source(&tokenizer)
+    {
+    }
+
+    // Streaming mode, takes batches from a tokenizer on another thread
+    // (Tokenizer::tokenize_into)
+    inline explicit TokenCursor(SpscRing<TokenBuffer> &ring)
+        : m_ring(&ring)
+    {
+    }
+
+    // Reads the tokens [begin, end) of a buffer owned by someone else,
+    // e.g. one piece of a program that is parsed on several threads
+    inline TokenCursor(const TokenBuffer &tokens, const size_t begin, const size_t end)
+        : m_buffer(&tokens),
+          m_index(begin),
+          m_end(end)
+    {
+    }
+
+    inline TokenCursor(TokenCursor &&other) noexcept
+        : m_tokens(std::move(other.m_tokens)),
+          m_buffer(other.m_buffer == &other.m_tokens ? &m_tokens : other.m_buffer),
+          m_index(other.m_index),
+          m_end(other.m_end),
+          m_source(other.m_source),
+          m_ring(other.m_ring)
+    {
+    }
+
+    TokenCursor &operator=(TokenCursor &&) = delete;
+
+    [[nodiscard]] inline std::optional<TokenType> peek(const size_t offset = 0)
+    {
+        fill(offset);
+        if (m_index + offset >= m_end)
+        {
+            return {};
+        }
+        return m_buffer->type(m_index + offset);
+    }
+
+    [[nodiscard]] inline bool peek_is(const TokenType type, const size_t offset = 0)
+    {
+        fill(offset);
+        return m_index + offset < m_end && m_buffer->type(m_index + offset) == type;
+    }
+
+    inline TokenRef consume()
+    {
+        fill(0);
+        return m_index++;
+    }
+
+    [[nodiscard]] inline TokenType type(const TokenRef token) const
+    {
+        return m_buffer->type(token);
+    }
+
+    [[nodiscard]] inline Symbol symbol(const TokenRef token) const
+    {
+        return m_buffer->value(token);
+    }
+
+    [[nodiscard]] inline int64_t int_value(const TokenRef token) const
+    {
+        return m_buffer->int_value(token);
+    }
+
+    // where the token starts in the source, needs a buffer from
+    // Tokenizer::tokenize_with_offsets
+    [[nodiscard]] inline uint32_t offset(const TokenRef token) const
+    {
+        return m_buffer->offset(token);
+    }
+
+    [[nodiscard]] inline size_t size_hint() const
+    {
+        return m_end - m_index;
+    }
+
+private:
+    // Streaming mode: makes sure the token at m_index + offset has been pulled
+    // Consumed tokens are dropped every so often so the buffer only ever
+    // holds a few tokens (or batches) no matter how long the input is
+    inline void fill(const size_t offset)
+    {
+        if (m_source == nullptr && m_ring == nullptr)
+        {
+            return;
+        }
+        if (m_index >= 1024 && m_index * 2 >= m_tokens.size())
+        {
+            m_tokens.erase_front(m_index);
+            m_index = 0;
+        }
+        while (m_index + offset >= m_tokens.size())
+        {
+            if (m_ring != nullptr)
+            {
+                auto batch = m_ring->pop();
+                if (!batch.has_value())
+                {
+                    m_ring = nullptr;
+                    break;
+                }
+                m_tokens.append(batch.value());
+                continue;
+            }
+            auto token = m_source->next();
+            if (!token.has_value())
+            {
+                m_source = nullptr;
+                break;
+            }
+            m_tokens.push(token.value());
+        }
+        m_end = m_tokens.size();
+    }
+
+    TokenBuffer m_tokens;
+    // m_tokens, unless the cursor reads someone else's buffer
+    const TokenBuffer *m_buffer = &m_tokens;
+    size_t m_index = 0;
+    size_t m_end = 0;
+    // set while there are still tokens to pull in streaming mode
+    Tokenizer *m_source = nullptr;
+    SpscRing<TokenBuffer> *m_ring = nullptr;
+};
@@ -0,0 +1,404 @@
+#pragma once
+#include <cassert>
+#include <iostream>
+#include <optional>
+#include <string_view>
+#include <vector>
+#include "./errors.hpp"
+#include "./parser.hpp"
+#include "./ranges.hpp"
+
+// What the checker found out about the expression of a statement
+struct ExprInfo
+{
+    IntType type = IntType::none;
+    // only reads consts and literals, so value is known at compile time
+    bool constant = false;
+    // wrapped to the type's width, sign extended for signed types
+    uint64_t value = 0;
+};
+
+// value wrapped to the width of type the way the cpu would
+inline uint64_t wrap_to(const uint64_t value, const IntType type)
+{
+    const unsigned bits = type_size(type) * 8;
+    if (bits == 64)
+    {
+        return value;
+    }
+    const uint64_t low = value & ((uint64_t{1} << bits) - 1);
+    const uint64_t sign = uint64_t{1} << (bits - 1);
+    return is_signed(type) && (low & sign) != 0 ? low | ~((uint64_t{1} << bits) - 1) : low;
+}
+
+// lhs op rhs with the wrap around of type, the operands wrapped to it
+// already. Empty if the generated division would fault instead: on zero,
+// and on the minimum divided by -1 in the 32 and 64 bit registers
+// (narrower types are divided in 32 bits, so theirs just wraps)
+inline std::optional<uint64_t> fold_bin_expr(const NodeKind kind, const uint64_t lhs, const uint64_t rhs, const IntType type)
+{
+    uint64_t result;
+    switch (kind)
+    {
+    case NodeKind::bin_add:
+        result = lhs + rhs;
+        break;
+    case NodeKind::bin_sub:
+        result = lhs - rhs;
+        break;
+    case NodeKind::bin_multi:
+        result = lhs * rhs;
+        break;
+    default:
+        if (rhs == 0)
+        {
+            return {};
+        }
+        if (!is_signed(type))
+        {
+            result = lhs / rhs;
+        }
+        else if (type_size(type) >= 4 && lhs == ~type_max(type) && rhs == UINT64_MAX)
+        {
+            return {};
+        }
+        else
+        {
+            result = static_cast<uint64_t>(static_cast<int64_t>(lhs) / static_cast<int64_t>(rhs));
+        }
+        break;
+    }
+    return wrap_to(result, type);
+}
+
+// Type checking pass, runs over the prog before it is generated
+// Nothing converts between types, so all of an expression has one type:
+// the annotation of the variable it initializes if there is one, else
+// the type of the variables it reads (which have to agree), else u64
+// Integer literals take on the type of their expression and have to fit
+// in it. bool values can be copied and tested but not computed with
+// `const` declarations are evaluated here. One with an annotation is
+// typed like a variable, one without is computed as u64 and then used
+// like a literal, so it goes into any expression whose type it fits
+class TypeChecker
+{
+public:
+    inline explicit TypeChecker(const SymbolTable &symbols)
+        : m_symbols(symbols)
+    {
+    }
+
+    // Overflow in a const is an error instead of wrapping around, in any
+    // other expression it is left to trap at run time, see
+    // Generator::checked_arithmetic
+    inline void checked_arithmetic()
+    {
+        m_checked = true;
+    }
+
+    // Checks the top level statements of prog and describes the
+    // expression of every exit, let, const, if and elif, indexed by the
+    // statement (statements are never shared, expressions can be, see
+    // share_exprs)
+    // Top level names stay declared for the next call, so a prog can be
+    // checked a part at a time, see Generator::gen_stmts
+    inline std::vector<ExprInfo> check(const NodeProg &prog)
+    {
+        m_prog = &prog;
+        std::vector<ExprInfo> infos(prog.nodes.size());
+        m_marks.assign(prog.nodes.size(), 0);
+        m_epoch = 0;
+        for (const NodeIndex stmt : prog.stmts)
+        {
+            check_stmt(stmt, infos);
+        }
+        return infos;
+    }
+
+private:
+    // Walks the statement with an explicit stack like the generator,
+    // no_node on the stack marks the end of a scope
+    inline void check_stmt(const NodeIndex stmt, std::vector<ExprInfo> &infos)
+    {
+        m_work.push_back(stmt);
+        while (!m_work.empty())
+        {
+            const NodeIndex index = m_work.back();
+            m_work.pop_back();
+            if (index == no_node)
+            {
+                end_scope();
+                continue;
+            }
+            const Node &node = (*m_prog)[index];
+            switch (node.kind)
+            {
+            case NodeKind::stmt_exit:
+                infos[index] = check_expr(node.a, IntType::none, false);
+                break;
+            case NodeKind::stmt_let:
+            case NodeKind::stmt_const:
+            {
+                if (binding(node.a).kind != Binding::Kind::none)
+                {
+                    fail("Identifier ", m_symbols.name(node.a), " already exists");
+                }
+                const bool is_const = node.kind == NodeKind::stmt_const;
+                const auto declared = static_cast<IntType>(node.c);
+                infos[index] = check_expr(node.b, declared, is_const);
+                if (is_const)
+                {
+                    if (!infos[index].constant)
+                    {
+                        fail("Value of const ", m_symbols.name(node.a), " is not known at compile time");
+                    }
+                    declare(node.a, {.kind = Binding::Kind::const_, .type = declared, .value = infos[index].value});
+                }
+                else
+                {
+                    declare(node.a, {.kind = Binding::Kind::var, .type = infos[index].type});
+                }
+                break;
+            }
+            case NodeKind::stmt_scope:
+            {
+                m_scopes.push_back(m_names.size());
+                m_work.push_back(no_node);
+                const std::span<const NodeIndex> stmts = m_prog->scope_stmts(node);
+                m_work.insert(m_work.end(), stmts.rbegin(), stmts.rend());
+                break;
+            }
+            case NodeKind::stmt_if:
+            case NodeKind::if_pred_elif:
+                infos[index] = check_expr(node.a, IntType::none, false);
+                if (node.c != no_node)
+                {
+                    m_work.push_back(node.c);
+                }
+                m_work.push_back(node.b);
+                break;
+            case NodeKind::if_pred_else:
+                m_work.push_back(node.b);
+                break;
+            default:
+                assert(false && "not a statement");
+            }
+        }
+    }
+
+    // Type of the expression, declared if what it initializes has an
+    // annotation (none otherwise), and its value if it has no variables
+    // in it. Dividing by zero (or overflow, see checked_arithmetic) is an
+    // error in a const, anywhere else it just makes the value one for run
+    // time, where it traps
+    inline ExprInfo check_expr(const NodeIndex expr, const IntType declared, const bool is_const)
+    {
+        IntType type = declared;
+        bool arithmetic = false;
+        bool constant = true;
+        // a shared node only has to be looked at once
+        m_epoch++;
+        m_literals.clear();
+        m_expr_stack.push_back(expr);
+        while (!m_expr_stack.empty())
+        {
+            const NodeIndex index = m_expr_stack.back();
+            m_expr_stack.pop_back();
+            if (m_marks[index] == m_epoch)
+            {
+                continue;
+            }
+            m_marks[index] = m_epoch;
+            const Node &node = (*m_prog)[index];
+            switch (node.kind)
+            {
+            case NodeKind::term_int_lit:
+                m_literals.push_back({literal_name, static_cast<uint64_t>(m_prog->int_value(node))});
+                break;
+            case NodeKind::term_ident:
+            {
+                const Binding &bound = binding(node.a);
+                if (bound.kind == Binding::Kind::none)
+                {
+                    fail("Identifier ", m_symbols.name(node.a), " does not exist");
+                }
+                constant = constant && bound.kind == Binding::Kind::const_;
+                if (bound.type == IntType::none)
+                {
+                    // an untyped const
+                    m_literals.push_back({node.a, bound.value});
+                }
+                else if (type == IntType::none)
+                {
+                    type = bound.type;
+                }
+                else if (bound.type != type)
+                {
+                    fail("Type mismatch: ", m_symbols.name(node.a), " is ", type_name(bound.type), ", expected ", type_name(type));
+                }
+                break;
+            }
+            default:
+                arithmetic = true;
+                m_expr_stack.push_back(node.a);
+                m_expr_stack.push_back(node.b);
+                break;
+            }
+        }
+
+        if (type == IntType::none)
+        {
+            type = default_int_type;
+        }
+        if (arithmetic && type == IntType::bool_)
+        {
+            fail("Arithmetic on bool values is not allowed");
+        }
+        for (const auto &[name, value] : m_literals)
+        {
+            if (value > type_max(type))
+            {
+                if (name != literal_name)
+                {
+                    fail("Value ", value, " of const ", m_symbols.name(name), " does not fit in ", type_name(type));
+                }
+                fail("Integer literal ", value, " does not fit in ", type_name(type));
+            }
+        }
+
+        ExprInfo info{.type = type};
+        if (constant)
+        {
+            const std::optional<uint64_t> value = evaluate(expr, type);
+            if (value.has_value())
+            {
+                info.constant = true;
+                info.value = value.value();
+            }
+            else if (is_const)
+            {
+                fail(m_fault, " in constant expression");
+            }
+        }
+        return info;
+    }
+
+    // Computes an expression of consts and literals with the wrap around
+    // of type, empty if a division in it would fault (see fold_bin_expr)
+    // or, with checked arithmetic, an operation in it would trap
+    // Post order over an explicit stack, like Generator::gen_expr
+    inline std::optional<uint64_t> evaluate(const NodeIndex expr, const IntType type)
+    {
+        m_values.clear();
+        m_eval_stack.push_back({expr, false});
+        while (!m_eval_stack.empty())
+        {
+            const auto [index, operands_done] = m_eval_stack.back();
+            m_eval_stack.pop_back();
+            const Node &node = (*m_prog)[index];
+            if (node.kind == NodeKind::term_int_lit)
+            {
+                m_values.push_back(static_cast<uint64_t>(m_prog->int_value(node)));
+                continue;
+            }
+            if (node.kind == NodeKind::term_ident)
+            {
+                m_values.push_back(wrap_to(binding(node.a).value, type));
+                continue;
+            }
+            if (!operands_done)
+            {
+                m_eval_stack.push_back({index, true});
+                m_eval_stack.push_back({node.b, false});
+                m_eval_stack.push_back({node.a, false});
+                continue;
+            }
+            const uint64_t rhs = m_values.back();
+            m_values.pop_back();
+            const uint64_t lhs = m_values.back();
+            const std::optional<uint64_t> result = fold_bin_expr(node.kind, lhs, rhs, type);
+            if (!result.has_value())
+            {
+                m_fault = rhs == 0 ? "Division by zero" : "Division overflow";
+                m_eval_stack.clear();
+                return {};
+            }
+            if (m_checked &&
+                op_range(node.kind, Interval::point_of(lhs, type), Interval::point_of(rhs, type), type, true).may_overflow)
+            {
+                m_fault = "Arithmetic overflow";
+                m_eval_stack.clear();
+                return {};
+            }
+            m_values.back() = result.value();
+        }
+        return m_values.back();
+    }
+
+    // what a name is bound to in the current scope
+    struct Binding
+    {
+        enum class Kind : uint8_t
+        {
+            none,
+            var,
+            const_,
+        } kind = Kind::none;
+        // none for a const without annotation
+        IntType type = IntType::none;
+        // of consts, untyped ones as u64
+        uint64_t value = 0;
+    };
+
+    [[nodiscard]] inline const Binding &binding(const Symbol name) const
+    {
+        static const Binding unbound;
+        return name < m_bindings.size() ? m_bindings[name] : unbound;
+    }
+
+    inline void declare(const Symbol name, const Binding &bound)
+    {
+        // see Generator::add_var
+        if (name >= m_bindings.size())
+        {
+            m_bindings.resize(std::max<size_t>(name + 1, m_bindings.size() * 2));
+        }
+        m_bindings[name] = bound;
+        m_names.push_back(name);
+    }
+
+    inline void end_scope()
+    {
+        for (size_t i = m_scopes.back(); i < m_names.size(); i++)
+        {
+            m_bindings[m_names[i]] = {};
+        }
+        m_names.resize(m_scopes.back());
+        m_scopes.pop_back();
+    }
+
+    const SymbolTable &m_symbols;
+    bool m_checked = false;
+    const NodeProg *m_prog = nullptr;
+    // by Symbol, what the name means in the current scope
+    std::vector<Binding> m_bindings;
+    // names in the order they were declared, see Generator::m_vars
+    std::vector<Symbol> m_names;
+    // where each open scope's names start in m_names
+    std::vector<size_t> m_scopes;
+
+    std::vector<NodeIndex> m_work;
+    std::vector<NodeIndex> m_expr_stack;
+    // literals and untyped consts of the expression being checked, with the
+    // const's name (literal_name for a literal)
+    static constexpr Symbol literal_name = UINT32_MAX;
+    std::vector<std::pair<Symbol, uint64_t>> m_literals;
+    // by NodeIndex, m_epoch of the last expression the node was seen in
+    std::vector<uint32_t> m_marks;
+    uint32_t m_epoch = 0;
+    // scratch stacks of evaluate
+    std::vector<std::pair<NodeIndex, bool>> m_eval_stack;
+    std::vector<uint64_t> m_values;
+    // why the last evaluate came back empty
+    std::string_view m_fault;
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <string_view>
+
+// Static types of values, every variable and expression has exactly one
+// none is only used for a `let` without annotation, whose type is
+// inferred from its expression
+// bool is stored like u8 and only ever holds 0 or 1
+enum class IntType : uint8_t
+{
+    none,
+    u8,
+    u16,
+    u32,
+    u64,
+    i8,
+    i16,
+    i32,
+    i64,
+    bool_,
+};
+
+// what an unannotated variable gets when nothing else decides it,
+// same as every value used to be
+inline constexpr IntType default_int_type = IntType::u64;
+
+// bytes the type takes in memory
+inline unsigned type_size(const IntType type)
+{
+    switch (type)
+    {
+    case IntType::u8:
+    case IntType::i8:
+    case IntType::bool_:
+        return 1;
+    case IntType::u16:
+    case IntType::i16:
+        return 2;
+    case IntType::u32:
+    case IntType::i32:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+inline bool is_signed(const IntType type)
+{
+    return type >= IntType::i8 && type <= IntType::i64;
+}
+
+// largest value of the type, literals have to fit under it (they are never negative)
+inline uint64_t type_max(const IntType type)
+{
+    if (type == IntType::bool_)
+    {
+        return 1;
+    }
+    const unsigned bits = type_size(type) * 8 - (is_signed(type) ? 1 : 0);
+    return bits == 64 ? UINT64_MAX : (uint64_t{1} << bits) - 1;
+}
+
+inline std::string_view type_name(const IntType type)
+{
+    switch (type)
+    {
+    case IntType::none:
+        return "<inferred>";
+    case IntType::u8:
+        return "u8";
+    case IntType::u16:
+        return "u16";
+    case IntType::u32:
+        return "u32";
+    case IntType::u64:
+        return "u64";
+    case IntType::i8:
+        return "i8";
+    case IntType::i16:
+        return "i16";
+    case IntType::i32:
+        return "i32";
+    case IntType::i64:
+        return "i64";
+    case IntType::bool_:
+        return "bool";
+    }
+    return "?";
+}